@@ -0,0 +1,99 @@
+//Micro benchmark of the edge-function rasterization kernels.
+//Usage: TRRasterBench [number of triangles] [max triangle size in pixels]
+
+#include "glm/glm.hpp"
+
+#include "TRShadingPipeline.h"
+#include "TRRasterKernel.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+using namespace TinyRenderer;
+
+int main(int argc, char* args[])
+{
+	constexpr int width = 1920;
+	constexpr int height = 1080;
+	const int num_triangles = (argc > 1) ? std::atoi(args[1]) : 20000;
+	const int max_size = (argc > 2) ? std::atoi(args[2]) : 64;
+
+	//Random screen space triangles with a fixed seed
+	std::vector<TRShadingPipeline::VertexData> triangles(num_triangles * 3);
+	{
+		std::mt19937 rng(20231025);
+		std::uniform_int_distribution<int> centerX(0, width - 1), centerY(0, height - 1);
+		std::uniform_int_distribution<int> offset(-max_size / 2, max_size / 2);
+		std::uniform_real_distribution<float> depth(-1.0f, 1.0f);
+		for (auto &vert : triangles)
+		{
+			vert.spos = glm::ivec2(0);
+			vert.cpos = glm::vec4(0.0f, 0.0f, depth(rng), 1.0f);
+		}
+		for (int t = 0; t < num_triangles; ++t)
+		{
+			glm::ivec2 center(centerX(rng), centerY(rng));
+			for (int v = 0; v < 3; ++v)
+			{
+				triangles[t * 3 + v].spos = center + glm::ivec2(offset(rng), offset(rng));
+			}
+		}
+	}
+
+	const glm::ivec4 screen(0, 0, width - 1, height - 1);
+	auto occluded = [](int, int, int, int, float) -> bool { return false; };
+	auto fragment = [](TRShadingPipeline::VertexData &, unsigned int, const float *) {};
+
+	std::cout << "Rasterizing " << num_triangles << " triangles (max size " << max_size
+		<< "px) at " << width << "x" << height << std::endl;
+
+	const TRRasterKernel::KernelType kernels[] = {
+		TRRasterKernel::TR_KERNEL_SCALAR,
+		TRRasterKernel::TR_KERNEL_SSE2,
+		TRRasterKernel::TR_KERNEL_AVX2 };
+	const TRRasterKernel::KernelType default_kernel = TRRasterKernel::getKernelType();
+
+	for (auto kernel : kernels)
+	{
+		if (!TRRasterKernel::setKernelType(kernel))
+		{
+			std::cout << std::setw(8) << TRRasterKernel::getKernelName(kernel) << ": not supported" << std::endl;
+			continue;
+		}
+
+		//Note: the depth test rejects every pixel, so this measures coverage, barycentric weights and depth
+		unsigned long long num_pixels = 0;
+		auto depth_test = [&](int, int, const float *depth, unsigned int) -> unsigned int { num_pixels += (depth[0] <= 1.0f); return 0; };
+
+		//Repeat until we have a stable measurement
+		int passes = 0;
+		double seconds = 0.0;
+		auto start = std::chrono::high_resolution_clock::now();
+		while (seconds < 1.0)
+		{
+			for (int t = 0; t < num_triangles; ++t)
+			{
+				TRShadingPipeline::rasterize_fill_edge_function<1>(triangles[t * 3 + 0], triangles[t * 3 + 1],
+					triangles[t * 3 + 2], screen, TR_VARYING_ALL, occluded, depth_test, fragment);
+			}
+			++passes;
+			seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+
+		double tris_per_sec = static_cast<double>(num_triangles) * passes / seconds;
+		double pixels_per_sec = static_cast<double>(num_pixels) / seconds;
+		std::cout << std::setw(8) << TRRasterKernel::getKernelName(kernel) << ": "
+			<< std::fixed << std::setprecision(2)
+			<< std::setw(10) << tris_per_sec / 1e6 << " Mtris/s, "
+			<< std::setw(10) << pixels_per_sec / 1e6 << " Mpixels/s"
+			<< (kernel == default_kernel ? "  (default)" : "") << std::endl;
+	}
+
+	TRRasterKernel::setKernelType(default_kernel);
+
+	return 0;
+}
@@ -0,0 +1,346 @@
+//Headless rendering of the scene in main.cpp: no window, deterministic camera path,
+//per-frame and per-stage timings are reported as JSON.
+//Usage: TRHeadless [--frames N] [--width W] [--height H] [--threads T] [--lights L] [--msaa] [--prepass]
+//                  [--deferred] [--fixed-camera] [--model-dir DIR] [--save PREFIX] [--json FILE] [--heatmap PREFIX]
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "TRRenderer.h"
+#include "TRUtils.h"
+
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace TinyRenderer;
+
+struct FrameRecord
+{
+	double clear = 0.0;
+	double vertex = 0.0;
+	double clip = 0.0;
+	double raster = 0.0;
+	double present = 0.0;
+	double total = 0.0;
+	unsigned int clipped = 0;
+	unsigned int culled = 0;
+	TRPipelineStatistics statistics;
+};
+
+static void printUsage()
+{
+	std::cout << "Usage: TRHeadless [--frames N] [--width W] [--height H] [--threads T] [--lights L] [--msaa] [--prepass]\n"
+		<< "                  [--deferred] [--fixed-camera] [--model-dir DIR] [--save PREFIX] [--json FILE] [--heatmap PREFIX]\n"
+		<< "  --frames N       number of rendered frames (default 60)\n"
+		<< "  --width/--height size of the frame buffer (default 666x500)\n"
+		<< "  --threads T      rendering threads, 0 means hardware concurrency (default 0)\n"
+		<< "  --lights L       extra small point and spot lights around the model (default 0)\n"
+		<< "  --msaa           4x multisample anti-aliasing\n"
+		<< "  --prepass        depth prepass, shade each visible fragment once\n"
+		<< "  --deferred       deferred shading, relight the tiles whose geometry didn't change\n"
+		<< "  --fixed-camera   keep the camera still, only the lights move like in the interactive demo\n"
+		<< "  --model-dir DIR  directory of the models (default model)\n"
+		<< "  --save PREFIX    write every frame to PREFIX_XXXX.ppm\n"
+		<< "  --json FILE      write the timings to FILE instead of stdout\n"
+		<< "  --heatmap PREFIX write the overdraw of every frame to PREFIX_XXXX.ppm\n"
+		<< "                   (requires a build with TR_ENABLE_STATISTICS)\n";
+}
+
+static bool writePPM(const std::string &filename, const std::vector<unsigned char> &rgb, int width, int height)
+{
+	FILE *fp = std::fopen(filename.c_str(), "wb");
+	if (fp == nullptr)
+		return false;
+	std::fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	std::fwrite(rgb.data(), 1, rgb.size(), fp);
+	std::fclose(fp);
+	return true;
+}
+
+static void writeFrameJSON(FILE *fp, const FrameRecord &rec)
+{
+	std::fprintf(fp, "\"total_ms\": %.3f, \"clear_ms\": %.3f, \"vertex_ms\": %.3f, \"clip_ms\": %.3f, "
+		"\"raster_ms\": %.3f, \"present_ms\": %.3f, \"clipped_faces\": %u, \"culled_faces\": %u",
+		rec.total, rec.clear, rec.vertex, rec.clip, rec.raster, rec.present, rec.clipped, rec.culled);
+	if (TRPipelineStatistics::isEnabled())
+	{
+		const TRPipelineStatistics &stats = rec.statistics;
+		std::fprintf(fp, ", \"cluster_culled_faces\": %llu, \"vertices_shaded\": %llu, \"triangles_assembled\": %llu, "
+			"\"triangles_rasterized\": %llu, \"fragments_generated\": %llu, \"fragments_passed\": %llu, "
+			"\"pixels_shaded\": %llu, \"overdraw\": %.3f, \"texture_samples\": %llu",
+			stats.clusterCulledFaces, stats.verticesShaded, stats.trianglesAssembled, stats.trianglesRasterized,
+			stats.fragmentsGenerated, stats.fragmentsPassed, stats.pixelsShaded,
+			stats.getOverdrawRatio(), stats.textureSamples);
+	}
+}
+
+int main(int argc, char* args[])
+{
+	int width = 666;
+	int height = 500;
+	int num_frames = 60;
+	int num_threads = 0;
+	int num_extra_lights = 0;
+	bool msaa = false;
+	bool prepass = false;
+	bool deferred = false;
+	bool fixed_camera = false;
+	std::string model_dir = "model";
+	std::string save_prefix;
+	std::string json_file;
+	std::string heatmap_prefix;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = args[i];
+		bool has_value = (i + 1 < argc);
+		if (arg == "--frames" && has_value) num_frames = std::atoi(args[++i]);
+		else if (arg == "--width" && has_value) width = std::atoi(args[++i]);
+		else if (arg == "--height" && has_value) height = std::atoi(args[++i]);
+		else if (arg == "--threads" && has_value) num_threads = std::atoi(args[++i]);
+		else if (arg == "--lights" && has_value) num_extra_lights = std::atoi(args[++i]);
+		else if (arg == "--msaa") msaa = true;
+		else if (arg == "--prepass") prepass = true;
+		else if (arg == "--deferred") deferred = true;
+		else if (arg == "--fixed-camera") fixed_camera = true;
+		else if (arg == "--model-dir" && has_value) model_dir = args[++i];
+		else if (arg == "--save" && has_value) save_prefix = args[++i];
+		else if (arg == "--json" && has_value) json_file = args[++i];
+		else if (arg == "--heatmap" && has_value) heatmap_prefix = args[++i];
+		else
+		{
+			printUsage();
+			return (arg == "--help" || arg == "-h") ? 0 : -1;
+		}
+	}
+	if (width <= 0 || height <= 0 || num_frames <= 0 || num_extra_lights < 0)
+	{
+		printUsage();
+		return -1;
+	}
+	if (!heatmap_prefix.empty() && !TRPipelineStatistics::isEnabled())
+	{
+		std::cerr << "The overdraw heatmap requires a build with TR_ENABLE_STATISTICS" << std::endl;
+		return -1;
+	}
+
+	TRRenderer::ptr renderer = std::make_shared<TRRenderer>(width, height);
+	renderer->setNumberOfThreads(num_threads);
+	if (msaa && !renderer->setMultisampleMode(TRMultisampleMode::TR_MSAA_4X))
+	{
+		return -1;
+	}
+	if (prepass)
+	{
+		renderer->setDepthPrepassMode(TRDepthPrepassMode::TR_DEPTH_PREPASS_ENABLE);
+	}
+	if (deferred)
+	{
+		renderer->setDeferredShadingMode(TRDeferredShadingMode::TR_DEFERRED_SHADING_ENABLE);
+	}
+
+	//camera
+	glm::vec3 cameraPos = glm::vec3(0.8f, 0.0f, 3.7f);
+	glm::vec3 lookAtTarget = glm::vec3(0.0f);
+
+	renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f)));
+	renderer->setProjectMatrix(TRUtils::calcPerspProjectMatrix(45.0f, static_cast<float>(width) / height, 0.001f, 10.0f), 0.001f, 10.0f);
+
+	//Load the rendering data
+	TRDrawableMesh::ptr diabloMesh = std::make_shared<TRDrawableMesh>(model_dir + "/diablo3_pose/diablo3_pose.obj");
+	TRDrawableMesh::ptr houseMesh = std::make_shared<TRDrawableMesh>(model_dir + "/floor.obj");
+	TRDrawableMesh::ptr redLightMesh = std::make_shared<TRDrawableMesh>(model_dir + "/light_red.obj");
+	TRDrawableMesh::ptr greenLightMesh = std::make_shared<TRDrawableMesh>(model_dir + "/light_green.obj");
+	TRDrawableMesh::ptr blueLightMesh = std::make_shared<TRDrawableMesh>(model_dir + "/light_blue.obj");
+	renderer->addDrawableMesh({ houseMesh, diabloMesh, redLightMesh, greenLightMesh, blueLightMesh });
+	redLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
+	greenLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
+	blueLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
+
+	renderer->setShaderPipeline(std::make_shared<TRPhongShadingPipeline>());
+
+	//Point light sources
+	glm::vec3 redLightPos = glm::vec3(0.0f, -0.05f, 1.2f);
+	glm::vec3 greenLightPos = glm::vec3(0.87f, -0.05f, -0.87f);
+	glm::vec3 blueLightPos = glm::vec3(-0.83f, -0.05f, -0.83f);
+	int redLightIndex = renderer->addPointLight(redLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(1.9f, 0.0f, 0.0f));
+	int greenLightIndex = renderer->addPointLight(greenLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(0.0f, 1.9f, 0.0f));
+	int blueLightIndex = renderer->addPointLight(blueLightPos, glm::vec3(1.0, 0.7, 1.8), glm::vec3(0.0f, 0.0f, 1.9f));
+
+	redLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), redLightPos));
+	greenLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), greenLightPos));
+	blueLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), blueLightPos));
+
+	//Extra short range lights on a spiral around the model, every other one is a spot light aiming down
+	for (int i = 0; i < num_extra_lights; ++i)
+	{
+		const float angle = i * 2.39996f;
+		const float radius = 1.5f * std::sqrt((i + 0.5f) / num_extra_lights);
+		const glm::vec3 pos(radius * std::cos(angle), (i % 4 < 2) ? -0.3f : 0.3f, radius * std::sin(angle));
+		const glm::vec3 color = 0.5f * glm::vec3(
+			0.5f + 0.5f * std::cos(angle), 0.5f + 0.5f * std::cos(angle + 2.094f), 0.5f + 0.5f * std::cos(angle + 4.189f));
+		const glm::vec3 atten(1.0f, 14.0f, 400.0f);
+		if (i % 2 == 0)
+			renderer->addPointLight(pos, atten, color);
+		else
+			renderer->addSpotLight(pos, glm::vec3(0.0f, -1.0f, 0.0f), color, atten, 25.0f, 35.0f);
+	}
+
+	//Note: adding lights may reallocate the light array, so only take the references once all are added
+	auto &redLight = renderer->getPointLight(redLightIndex);
+	auto &greenLight = renderer->getPointLight(greenLightIndex);
+	auto &blueLight = renderer->getPointLight(blueLightIndex);
+
+	//Note: fixed time step and camera path, so every run renders exactly the same frames
+	constexpr double deltaTime = 1000.0 / 60.0;
+	constexpr float cameraStep = 0.02f;
+
+	typedef std::chrono::high_resolution_clock Clock;
+	auto elapsed_ms = [](const Clock::time_point &beg, const Clock::time_point &end) -> double
+	{
+		return std::chrono::duration<double, std::milli>(end - beg).count();
+	};
+
+	std::vector<FrameRecord> records(num_frames);
+	std::vector<unsigned char> frame(width * height * 3);
+	for (int f = 0; f < num_frames; ++f)
+	{
+		FrameRecord &rec = records[f];
+		const auto frame_beg = Clock::now();
+
+		//Clear frame buffer (both color buffer and depth buffer)
+		renderer->clearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+		const auto render_beg = Clock::now();
+
+		//Draw call
+		renderer->setViewerPos(cameraPos);
+		renderer->renderAllDrawableMeshes();
+		const auto present_beg = Clock::now();
+
+		//Present: copy the rendered result out of the frame buffer, and save it on demand
+		{
+			const unsigned char *pixels = renderer->commitRenderedColorBuffer();
+			for (int i = 0; i < width * height; ++i)
+			{
+				frame[i * 3 + 0] = pixels[i * 4 + 0];
+				frame[i * 3 + 1] = pixels[i * 4 + 1];
+				frame[i * 3 + 2] = pixels[i * 4 + 2];
+			}
+			if (!save_prefix.empty())
+			{
+				char suffix[32];
+				std::snprintf(suffix, sizeof(suffix), "_%04d.ppm", f);
+				if (!writePPM(save_prefix + suffix, frame, width, height))
+				{
+					std::cerr << "Failed to write " << save_prefix + suffix << std::endl;
+				}
+			}
+		}
+		const auto frame_end = Clock::now();
+
+		const TRRenderer::FrameTimings &timings = renderer->getFrameTimings();
+		rec.clear = elapsed_ms(frame_beg, render_beg);
+		rec.vertex = timings.vertexStage;
+		rec.clip = timings.clipStage;
+		rec.raster = timings.rasterStage;
+		rec.present = elapsed_ms(present_beg, frame_end);
+		rec.total = elapsed_ms(frame_beg, frame_end);
+		rec.clipped = renderer->getNumberOfClipFaces();
+		rec.culled = renderer->getNumberOfCullFaces();
+		rec.statistics = renderer->getPipelineStatistics();
+
+		if (!heatmap_prefix.empty())
+		{
+			char suffix[32];
+			std::snprintf(suffix, sizeof(suffix), "_%04d.ppm", f);
+			if (!renderer->dumpOverdrawHeatmap(heatmap_prefix + suffix))
+			{
+				std::cerr << "Failed to write " << heatmap_prefix + suffix << std::endl;
+			}
+		}
+
+		//Model transformation
+		{
+			glm::mat4 redLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(0, 1, 0));
+			redLightPos = glm::vec3(redLightModelMat * glm::vec4(redLightPos, 1.0f));
+			redLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), redLightPos));
+			redLight.lightPos = redLightPos;
+
+			glm::mat4 greenLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(1, 1, 1));
+			greenLightPos = glm::vec3(greenLightModelMat * glm::vec4(greenLightPos, 1.0f));
+			greenLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), greenLightPos));
+			greenLight.lightPos = greenLightPos;
+
+			glm::mat4 blueLightModelMat = glm::rotate(glm::mat4(1.0f), (float)deltaTime * 0.0008f, glm::vec3(-1, 1, 1));
+			blueLightPos = glm::vec3(blueLightModelMat * glm::vec4(blueLightPos, 1.0f));
+			blueLightMesh->setModelMatrix(glm::translate(glm::mat4(1.0f), blueLightPos));
+			blueLight.lightPos = blueLightPos;
+		}
+
+		//Camera orbits around the target
+		if (!fixed_camera)
+		{
+			glm::mat4 cameraRotMat = glm::rotate(glm::mat4(1.0f), cameraStep, glm::vec3(0, 1, 0));
+			cameraPos = glm::vec3(cameraRotMat * glm::vec4(cameraPos, 1.0f));
+			renderer->setViewMatrix(TRUtils::calcViewMatrix(cameraPos, lookAtTarget, glm::vec3(0.0, 1.0, 0.0f)));
+		}
+	}
+
+	renderer->unloadDrawableMesh();
+
+	//Report
+	FrameRecord average;
+	for (const auto &rec : records)
+	{
+		average.clear += rec.clear / num_frames;
+		average.vertex += rec.vertex / num_frames;
+		average.clip += rec.clip / num_frames;
+		average.raster += rec.raster / num_frames;
+		average.present += rec.present / num_frames;
+		average.total += rec.total / num_frames;
+		average.clipped += rec.clipped;
+		average.culled += rec.culled;
+		average.statistics += rec.statistics;
+	}
+	average.clipped /= num_frames;
+	average.culled /= num_frames;
+	{
+		TRPipelineStatistics &stats = average.statistics;
+		stats.clusterCulledFaces /= num_frames;
+		stats.verticesShaded /= num_frames;
+		stats.trianglesAssembled /= num_frames;
+		stats.trianglesRasterized /= num_frames;
+		stats.fragmentsGenerated /= num_frames;
+		stats.fragmentsPassed /= num_frames;
+		stats.pixelsShaded /= num_frames;
+		stats.textureSamples /= num_frames;
+	}
+
+	FILE *fp = json_file.empty() ? stdout : std::fopen(json_file.c_str(), "w");
+	if (fp == nullptr)
+	{
+		std::cerr << "Failed to write " << json_file << std::endl;
+		return -1;
+	}
+	std::fprintf(fp, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n  \"frames\": [\n",
+		width, height, renderer->getNumberOfThreads());
+	for (int f = 0; f < num_frames; ++f)
+	{
+		std::fprintf(fp, "    { \"frame\": %d, ", f);
+		writeFrameJSON(fp, records[f]);
+		std::fprintf(fp, " }%s\n", (f + 1 < num_frames) ? "," : "");
+	}
+	std::fprintf(fp, "  ],\n  \"average\": { ");
+	writeFrameJSON(fp, average);
+	std::fprintf(fp, " }\n}\n");
+	if (fp != stdout)
+		std::fclose(fp);
+
+	return 0;
+}
@@ -1,38 +1,294 @@
 #include "TRDrawableMesh.h"
 
 
-#include <map>
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <algorithm>
 #include <iostream>
+#include <functional>
+#include <unordered_map>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
 
 #include "TRTexture2D.h"
-#include "TRShadingPipeline.h"
+#include "TRMeshCache.h"
+#include "TRThreadPool.h"
 
 namespace TinyRenderer
 {
+	//Unique vertex lookup of the OBJ loading
+	struct TRMeshVertexHash
+	{
+		size_t operator()(const TRMeshVertex &v) const
+		{
+			size_t hash = v.vposIndex;
+			hash = hash * 0x9E3779B1u + v.vnorIndex;
+			hash = hash * 0x9E3779B1u + v.vtexIndex;
+			return hash;
+		}
+	};
+
+	struct TRMeshVertexEqual
+	{
+		bool operator()(const TRMeshVertex &a, const TRMeshVertex &b) const
+		{
+			return a.vposIndex == b.vposIndex && a.vnorIndex == b.vnorIndex && a.vtexIndex == b.vtexIndex;
+		}
+	};
 
-	TRDrawableMesh::TRDrawableMesh(const std::string &filename)
+	TRDrawableMesh::TRDrawableMesh(const std::string &filename, TRRenderContext::ptr context)
 	{
+		if (context != nullptr)
+		{
+			m_context = context;
+		}
 		loadMeshFromFile(filename);
 	}
 
+	TRDrawableMesh::TRDrawableMesh(const TRDrawableMesh& mesh)
+		: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_vertices(mesh.m_mesh_vertices), m_mesh_faces(mesh.m_mesh_faces),
+		m_mesh_materials(mesh.m_mesh_materials), m_mesh_batches(mesh.m_mesh_batches), m_mesh_clusters(mesh.m_mesh_clusters),
+		m_cluster_faces(mesh.m_cluster_faces),
+		m_bounding_box_min(mesh.m_bounding_box_min), m_bounding_box_max(mesh.m_bounding_box_max),
+		m_bounding_sphere(mesh.m_bounding_sphere), m_context(mesh.m_context)
+	{
+		retainTextures();
+	}
+
+	TRDrawableMesh::~TRDrawableMesh()
+	{
+		releaseTextures();
+	}
+
+	void TRDrawableMesh::retainTextures()
+	{
+		for (const auto &material : m_mesh_materials)
+		{
+			m_context->retainTexture2D(material.diffuseMapTexId);
+			m_context->retainTexture2D(material.specularMapTexId);
+			m_context->retainTexture2D(material.normalMapTexId);
+			m_context->retainTexture2D(material.glowMapTexId);
+		}
+	}
+
+	void TRDrawableMesh::releaseTextures()
+	{
+		for (const auto &material : m_mesh_materials)
+		{
+			m_context->releaseTexture2D(material.diffuseMapTexId);
+			m_context->releaseTexture2D(material.specularMapTexId);
+			m_context->releaseTexture2D(material.normalMapTexId);
+			m_context->releaseTexture2D(material.glowMapTexId);
+		}
+	}
+
 	void TRDrawableMesh::clear()
 	{
+		releaseTextures();
 		m_vertices_attrib.clear();
+		std::vector<TRMeshVertex>().swap(m_mesh_vertices);
 		std::vector<TRMeshFace>().swap(m_mesh_faces);
+		std::vector<TRMaterial>().swap(m_mesh_materials);
+		std::vector<TRMeshBatch>().swap(m_mesh_batches);
+		std::vector<TRMeshCluster>().swap(m_mesh_clusters);
+		std::vector<unsigned int>().swap(m_cluster_faces);
+		m_bounding_box_min = m_bounding_box_max = glm::vec3(0.0f);
+		m_bounding_sphere = glm::vec4(0.0f);
 	}
 
 	TRDrawableMesh& TRDrawableMesh::operator=(const TRDrawableMesh& mesh)
 	{
 		if (&mesh == this)
 			return *this;
+		releaseTextures();
 		m_vertices_attrib = mesh.m_vertices_attrib;
+		m_mesh_vertices = mesh.m_mesh_vertices;
 		m_mesh_faces = mesh.m_mesh_faces;
+		m_mesh_materials = mesh.m_mesh_materials;
+		m_mesh_batches = mesh.m_mesh_batches;
+		m_mesh_clusters = mesh.m_mesh_clusters;
+		m_cluster_faces = mesh.m_cluster_faces;
+		m_bounding_box_min = mesh.m_bounding_box_min;
+		m_bounding_box_max = mesh.m_bounding_box_max;
+		m_bounding_sphere = mesh.m_bounding_sphere;
+		m_context = mesh.m_context;
+		retainTextures();
 		return *this;
 	}
 
+	void TRDrawableMesh::buildMeshBatches()
+	{
+		//Note: stable sorting keeps the submission order of the faces within a material
+		std::stable_sort(m_mesh_faces.begin(), m_mesh_faces.end(),
+			[](const TRMeshFace &a, const TRMeshFace &b) { return a.materialId < b.materialId; });
+
+		m_mesh_batches.clear();
+		for (size_t f = 0; f < m_mesh_faces.size(); ++f)
+		{
+			if (m_mesh_batches.empty() || m_mesh_batches.back().materialId != m_mesh_faces[f].materialId)
+			{
+				TRMeshBatch batch;
+				batch.materialId = m_mesh_faces[f].materialId;
+				batch.firstFace = f;
+				batch.numFaces = 0;
+				m_mesh_batches.push_back(batch);
+			}
+			++m_mesh_batches.back().numFaces;
+		}
+	}
+
+	void TRDrawableMesh::computeBounds()
+	{
+		const auto &positions = m_vertices_attrib.vpositions;
+		if (positions.empty())
+		{
+			m_bounding_box_min = m_bounding_box_max = glm::vec3(0.0f);
+			m_bounding_sphere = glm::vec4(0.0f);
+			return;
+		}
+
+		m_bounding_box_min = m_bounding_box_max = glm::vec3(positions[0]);
+		for (const auto &pos : positions)
+		{
+			m_bounding_box_min = glm::min(m_bounding_box_min, glm::vec3(pos));
+			m_bounding_box_max = glm::max(m_bounding_box_max, glm::vec3(pos));
+		}
+
+		//Centered at the box, tighter than the sphere around the box
+		const glm::vec3 center = (m_bounding_box_min + m_bounding_box_max) * 0.5f;
+		float radius2 = 0.0f;
+		for (const auto &pos : positions)
+		{
+			const glm::vec3 offset = glm::vec3(pos) - center;
+			radius2 = std::max(radius2, glm::dot(offset, offset));
+		}
+		m_bounding_sphere = glm::vec4(center, std::sqrt(radius2));
+	}
+
+	void TRDrawableMesh::buildMeshClusters()
+	{
+		const auto &positions = m_vertices_attrib.vpositions;
+		m_mesh_clusters.clear();
+		m_cluster_faces.clear();
+		if (m_mesh_faces.empty())
+			return;
+
+		//Group the faces by the direction of their normals (a cell of the cube map face they point to),
+		//then by their positions along a Morton curve, so that a run of them has a narrow normal cone
+		//and small bounds. Note: only the clusters are ordered this way, the faces keep their order.
+		enum { NORMAL_CELLS = 4 };
+		const glm::vec3 extent = glm::max(m_bounding_box_max - m_bounding_box_min, glm::vec3(1e-6f));
+		auto face_normal = [&](const TRMeshFace &face) -> glm::vec3
+		{
+			const glm::vec3 p0(positions[face.vposIndex[0]]);
+			return glm::cross(glm::vec3(positions[face.vposIndex[1]]) - p0, glm::vec3(positions[face.vposIndex[2]]) - p0);
+		};
+		auto normal_cell = [&](const glm::vec3 &normal) -> unsigned int
+		{
+			const glm::vec3 abs_normal = glm::abs(normal);
+			const int axis = (abs_normal.x >= abs_normal.y && abs_normal.x >= abs_normal.z) ? 0 : (abs_normal.y >= abs_normal.z ? 1 : 2);
+			const float major = abs_normal[axis];
+			unsigned int cell = axis * 2 + (normal[axis] < 0.0f ? 1 : 0);
+			for (int i = 1; i < 3; ++i)
+			{
+				const float coord = (major > 0.0f) ? normal[(axis + i) % 3] / major : 0.0f;
+				cell = cell * NORMAL_CELLS + glm::clamp(static_cast<int>((coord + 1.0f) * 0.5f * NORMAL_CELLS), 0, NORMAL_CELLS - 1);
+			}
+			return cell;
+		};
+		auto morton_code = [&](const TRMeshFace &face) -> unsigned int
+		{
+			const glm::vec3 centroid = (glm::vec3(positions[face.vposIndex[0]]) + glm::vec3(positions[face.vposIndex[1]])
+				+ glm::vec3(positions[face.vposIndex[2]])) / 3.0f;
+			const glm::vec3 unit = glm::clamp((centroid - m_bounding_box_min) / extent, glm::vec3(0.0f), glm::vec3(1.0f));
+			unsigned int code = 0;
+			for (int i = 0; i < 3; ++i)
+			{
+				const unsigned int coord = static_cast<unsigned int>(unit[i] * 1023.0f);
+				for (int b = 0; b < 10; ++b)
+					code |= ((coord >> b) & 1u) << (3 * b + i);
+			}
+			return code;
+		};
+
+		//(normal cell, morton code, face)
+		std::vector<std::pair<unsigned long long, unsigned int>> keys(m_mesh_faces.size());
+		for (size_t f = 0; f < m_mesh_faces.size(); ++f)
+		{
+			const unsigned long long cell = normal_cell(face_normal(m_mesh_faces[f]));
+			keys[f] = std::make_pair((cell << 30) | morton_code(m_mesh_faces[f]), static_cast<unsigned int>(f));
+		}
+		std::sort(keys.begin(), keys.end());
+		m_cluster_faces.resize(keys.size());
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			m_cluster_faces[i] = keys[i].second;
+		}
+
+		//Cut the sorted faces into clusters, a cluster never spans two normal cells
+		for (unsigned int first = 0; first < keys.size(); )
+		{
+			unsigned int last = first + 1;
+			while (last < keys.size() && last - first < m_cluster_size && (keys[last].first >> 30) == (keys[first].first >> 30))
+				++last;
+
+			TRMeshCluster cluster;
+			cluster.firstFace = first;
+			cluster.numFaces = last - first;
+
+			//Bounding sphere centered at the bounding box
+			glm::vec3 box_min(std::numeric_limits<float>::max()), box_max(-std::numeric_limits<float>::max());
+			for (unsigned int i = first; i < last; ++i)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					const glm::vec3 pos(positions[m_mesh_faces[m_cluster_faces[i]].vposIndex[v]]);
+					box_min = glm::min(box_min, pos);
+					box_max = glm::max(box_max, pos);
+				}
+			}
+			const glm::vec3 center = (box_min + box_max) * 0.5f;
+			float radius2 = 0.0f;
+			for (unsigned int i = first; i < last; ++i)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					const glm::vec3 offset = glm::vec3(positions[m_mesh_faces[m_cluster_faces[i]].vposIndex[v]]) - center;
+					radius2 = std::max(radius2, glm::dot(offset, offset));
+				}
+			}
+			cluster.boundingSphere = glm::vec4(center, std::sqrt(radius2));
+
+			//Normal cone around the average face normal
+			//Note: a degenerate face has no facing at all, which keeps the cluster from being culled
+			bool degenerate = false;
+			glm::vec3 axis(0.0f);
+			for (unsigned int i = first; i < last && !degenerate; ++i)
+			{
+				const glm::vec3 normal = face_normal(m_mesh_faces[m_cluster_faces[i]]);
+				const float length = glm::length(normal);
+				degenerate = !(length > 0.0f);
+				axis += degenerate ? glm::vec3(0.0f) : normal / length;
+			}
+			float min_dot = -1.0f;
+			if (!degenerate && glm::length(axis) > 0.0f)
+			{
+				axis = glm::normalize(axis);
+				min_dot = 1.0f;
+				for (unsigned int i = first; i < last; ++i)
+				{
+					min_dot = std::min(min_dot, glm::dot(glm::normalize(face_normal(m_mesh_faces[m_cluster_faces[i]])), axis));
+				}
+			}
+			cluster.coneAxis = axis;
+			cluster.coneCutoff = (min_dot > 0.0f) ? std::sqrt(std::max(0.0f, 1.0f - min_dot * min_dot)) : 1.0f;
+			m_mesh_clusters.push_back(cluster);
+			first = last;
+		}
+	}
+
 	void TRDrawableMesh::loadMeshFromFile(const std::string &filename)
 	{
 		clear();
@@ -41,6 +297,19 @@ namespace TinyRenderer
 
 		tinyobj::ObjReaderConfig reader_config;
 
+		size_t pos = filename.find_last_of("/\\");
+		std::string baseDir = (pos != std::string::npos) ? filename.substr(0, pos) : reader_config.mtl_search_path;
+		baseDir = baseDir.empty() ? "./" : baseDir + "/";
+
+		//The processed mesh of the previous run
+		if (TRMeshCache::read(filename, baseDir, *this))
+		{
+			computeBounds();
+			buildMeshClusters();
+			return;
+		}
+
+		const auto parse_beg = std::chrono::high_resolution_clock::now();
 		tinyobj::ObjReader reader;
 
 		if (!reader.ParseFromFile(filename, reader_config)) 
@@ -54,7 +323,7 @@ namespace TinyRenderer
 
 		if (!reader.Warning().empty()) 
 		{
-			std::cout << "TinyObjReader: " << reader.Warning();
+			std::cerr << "TinyObjReader: " << reader.Warning();
 		}
 
 		auto& attrib = reader.GetAttrib();
@@ -63,13 +332,17 @@ namespace TinyRenderer
 
 		//Load the textures
 		std::vector<glm::ivec4> matTextureIds;
+		std::vector<std::string> matTextureNames;
 		{
-			//texDict is for avoiding redundant loading
-			std::map<std::string, int> texDict;
-
-			size_t pos = filename.find_last_of("/\\");
-			std::string baseDir = "./";
-			baseDir = ((pos != std::string::npos) ? filename.substr(0, pos) : reader_config.mtl_search_path) + "/";
+			//Note: the texture cache of the context avoids redundant loading, also across meshes,
+			//      and every returned id holds a reference released by clear()
+			auto loadTexture = [this, &baseDir](const std::string &texname) -> int
+			{
+				if (texname.empty())
+					return -1;
+				return m_context->loadTexture2D(baseDir + texname,
+					TRTextureWarpMode::TR_REPEAT, TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR);
+			};
 
 			for (size_t m = 0; m < materials.size(); ++m)
 			{
@@ -77,125 +350,145 @@ namespace TinyRenderer
 				glm::ivec4 texIds(-1, -1, -1, -1);
 				const tinyobj::material_t* mp = &materials[m];
 
-				//Load the diffuse texture and upload to shading pipeline
-				if (mp->diffuse_texname.length() > 0)
-				{
-					if (texDict.find(mp->diffuse_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.x = texDict[mp->diffuse_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr diffTex = std::make_shared<TRTexture2D>();
-						bool success = diffTex->loadTextureFromFile(baseDir + mp->diffuse_texname);
-						texIds.x = TRShadingPipeline::upload_texture_2D(diffTex);
-						texDict.insert({ mp->diffuse_texname, texIds.x });
-					}
-				}
-
-				//Load the specular texture and upload to shading pipeline
-				if (mp->specular_texname.length() > 0)
-				{
-					if (texDict.find(mp->specular_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.y = texDict[mp->specular_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr specuTex = std::make_shared<TRTexture2D>();
-						bool success = specuTex->loadTextureFromFile(baseDir + mp->specular_texname);
-						texIds.y = TRShadingPipeline::upload_texture_2D(specuTex);
-						texDict.insert({ mp->specular_texname, texIds.y });
-					}
-				}
-
-				//Load the normal texture and upload to shading pipeline
-				if (mp->bump_texname.length() > 0)
-				{
-					if (texDict.find(mp->bump_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.z = texDict[mp->bump_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr normTex = std::make_shared<TRTexture2D>();
-						bool success = normTex->loadTextureFromFile(baseDir + mp->bump_texname);
-						texIds.z = TRShadingPipeline::upload_texture_2D(normTex);
-					}
-				}
-
-				//Load the emissive texture and upload to shading pipeline
-				if (mp->emissive_texname.length() > 0)
-				{
-					if (texDict.find(mp->emissive_texname) != texDict.end())
-					{
-						//Already loaded
-						texIds.w = texDict[mp->emissive_texname];
-					}
-					else
-					{
-						TRTexture2D::ptr glowTex = std::make_shared<TRTexture2D>();
-						bool success = glowTex->loadTextureFromFile(baseDir + mp->emissive_texname);
-						texIds.w = TRShadingPipeline::upload_texture_2D(glowTex);
-						texDict.insert({ mp->emissive_texname, texIds.w });
-					}
-				}
+				//Load the diffuse, specular, normal and emissive textures
+				texIds.x = loadTexture(mp->diffuse_texname);
+				texIds.y = loadTexture(mp->specular_texname);
+				texIds.z = loadTexture(mp->bump_texname);
+				texIds.w = loadTexture(mp->emissive_texname);
+				matTextureNames.insert(matTextureNames.end(), { mp->diffuse_texname, 
+					mp->specular_texname, mp->bump_texname, mp->emissive_texname });
 
 				matTextureIds.push_back(texIds);
 			}
 
 		}
 
-		//Geometry loading
+		//Material table, the last one is the default material for the faces without a material
 		{
-			for (size_t i = 0; i < attrib.vertices.size(); i += 3)
+			for (size_t m = 0; m < materials.size(); ++m)
 			{
-				m_vertices_attrib.vpositions.push_back(
-					glm::vec4(attrib.vertices[i + 0], attrib.vertices[i + 1], attrib.vertices[i + 2], 1.0f));
-				m_vertices_attrib.vcolors.push_back(
-					glm::vec4(attrib.colors[i + 0], attrib.colors[i + 1], attrib.colors[i + 2], 1.0f));
+				const tinyobj::material_t* mp = &materials[m];
+				TRMaterial material;
+				material.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
+				material.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
+				material.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
+				material.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
+				material.shininess = mp->shininess;
+				material.diffuseMapTexId = matTextureIds[m].x;
+				material.specularMapTexId = matTextureIds[m].y;
+				material.normalMapTexId = matTextureIds[m].z;
+				material.glowMapTexId = matTextureIds[m].w;
+				m_mesh_materials.push_back(material);
 			}
-			for (size_t i = 0; i < attrib.normals.size(); i += 3)
+			m_mesh_materials.push_back(TRMaterial());
+		}
+
+		//Geometry loading
+		//Note: the attributes and the faces are converted in parallel chunks, each chunk writes
+		//      its own range of the preallocated arrays, so no locking is needed at all.
+		const auto ingest_beg = std::chrono::high_resolution_clock::now();
+		{
+			const auto &pool = TRThreadPool::getDefault();
+			auto parallelChunks = [&pool](size_t count, const std::function<void(size_t, size_t)> &func)
 			{
-				m_vertices_attrib.vnormals.push_back(
-					glm::vec3(attrib.normals[i + 0], attrib.normals[i + 1], attrib.normals[i + 2]));
-			}
-			for (size_t i = 0; i < attrib.texcoords.size(); i += 2)
+				const int num_chunks = static_cast<int>((count + m_load_chunk_size - 1) / m_load_chunk_size);
+				pool->parallelFor(0, num_chunks, [&](int chunk, int)
+				{
+					const size_t beg = static_cast<size_t>(chunk) * m_load_chunk_size;
+					func(beg, std::min(beg + m_load_chunk_size, count));
+				});
+			};
+
+			const size_t num_positions = attrib.vertices.size() / 3;
+			const size_t num_normals = attrib.normals.size() / 3;
+			const size_t num_texcoords = attrib.texcoords.size() / 2;
+			m_vertices_attrib.vpositions.resize(num_positions);
+			m_vertices_attrib.vcolors.resize(num_positions);
+			m_vertices_attrib.vnormals.resize(num_normals);
+			m_vertices_attrib.vtexcoords.resize(num_texcoords);
+			parallelChunks(num_positions, [&](size_t beg, size_t end)
 			{
-				m_vertices_attrib.vtexcoords.push_back(
-					glm::vec2(attrib.texcoords[i + 0], attrib.texcoords[i + 1]));
-			}
+				for (size_t i = beg; i < end; ++i)
+				{
+					m_vertices_attrib.vpositions[i] =
+						glm::vec4(attrib.vertices[3 * i + 0], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2], 1.0f);
+					m_vertices_attrib.vcolors[i] =
+						glm::vec4(attrib.colors[3 * i + 0], attrib.colors[3 * i + 1], attrib.colors[3 * i + 2], 1.0f);
+				}
+			});
+			parallelChunks(num_normals, [&](size_t beg, size_t end)
+			{
+				for (size_t i = beg; i < end; ++i)
+				{
+					m_vertices_attrib.vnormals[i] =
+						glm::vec3(attrib.normals[3 * i + 0], attrib.normals[3 * i + 1], attrib.normals[3 * i + 2]);
+				}
+			});
+			parallelChunks(num_texcoords, [&](size_t beg, size_t end)
+			{
+				for (size_t i = beg; i < end; ++i)
+				{
+					m_vertices_attrib.vtexcoords[i] = glm::vec2(attrib.texcoords[2 * i + 0], attrib.texcoords[2 * i + 1]);
+				}
+			});
+
+			//Face chunks of the shapes, with their offsets into the index list and the face array
+			struct FaceChunk
+			{
+				size_t shape, firstFace, numFaces;
+				size_t indexOffset;
+				size_t outputOffset;
+			};
+			std::vector<FaceChunk> chunks;
+			size_t num_faces = 0;
 			for (size_t s = 0; s < shapes.size(); ++s)
 			{
+				const auto &num_face_vertices = shapes[s].mesh.num_face_vertices;
 				size_t index_offset = 0;
-				for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); ++f)
+				for (size_t f = 0; f < num_face_vertices.size(); f += m_load_chunk_size)
+				{
+					FaceChunk chunk;
+					chunk.shape = s;
+					chunk.firstFace = f;
+					chunk.numFaces = std::min<size_t>(m_load_chunk_size, num_face_vertices.size() - f);
+					chunk.indexOffset = index_offset;
+					chunk.outputOffset = num_faces;
+					chunks.push_back(chunk);
+					for (size_t k = 0; k < chunk.numFaces; ++k)
+					{
+						index_offset += num_face_vertices[f + k];
+					}
+					num_faces += chunk.numFaces;
+				}
+			}
+
+			m_mesh_faces.resize(num_faces);
+			pool->parallelFor(0, static_cast<int>(chunks.size()), [&](int c, int)
+			{
+				const FaceChunk &chunk = chunks[c];
+				const auto &mesh = shapes[chunk.shape].mesh;
+				size_t index_offset = chunk.indexOffset;
+				for (size_t f = chunk.firstFace; f < chunk.firstFace + chunk.numFaces; ++f)
 				{
-					int fv = shapes[s].mesh.num_face_vertices[f];
-					TRMeshFace face;
-					for (size_t v = 0; v < fv && v < 3; ++v)
+					int fv = mesh.num_face_vertices[f];
+					TRMeshFace &face = m_mesh_faces[chunk.outputOffset + (f - chunk.firstFace)];
+					for (size_t v = 0; v < static_cast<size_t>(fv) && v < 3; ++v)
 					{
-						tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+						tinyobj::index_t idx = mesh.indices[index_offset + v];
 						face.vposIndex[v] = idx.vertex_index;
 						face.vnorIndex[v] = idx.normal_index;
 						face.vtexIndex[v] = idx.texcoord_index;
 					}
 					//Material
 					{
-						if (shapes[s].mesh.material_ids[f] < materials.size())
+						const int material_id = mesh.material_ids[f];
+						if (material_id >= 0 && static_cast<size_t>(material_id) < materials.size())
+						{
+							face.materialId = material_id;
+						}
+						else
 						{
-							const tinyobj::material_t* mp = &materials[shapes[s].mesh.material_ids[f]];
-							face.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
-							face.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
-							face.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
-							face.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
-							face.shininess = mp->shininess;
-							face.diffuseMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].x;
-							face.specularMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].y;
-							face.normalMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].z;
-							face.glowMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].w;
+							face.materialId = m_mesh_materials.size() - 1;
 						}
 					}
 
@@ -229,12 +522,50 @@ namespace TinyRenderer
 						face.bitangent = glm::normalize(bitangent);
 					}
 
-					m_mesh_faces.push_back(face);
 					index_offset += fv;
 				}
+			});
+
+			//vertDict is for merging the vertices shared by the faces
+			//Note: serial in the face order, so the vertices are numbered by their first use
+			std::unordered_map<TRMeshVertex, unsigned int, TRMeshVertexHash, TRMeshVertexEqual> vertDict;
+			vertDict.reserve(num_positions);
+			for (auto &face : m_mesh_faces)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					TRMeshVertex vert;
+					vert.vposIndex = face.vposIndex[v];
+					vert.vnorIndex = face.vnorIndex[v];
+					vert.vtexIndex = face.vtexIndex[v];
+					auto iter = vertDict.insert({ vert, static_cast<unsigned int>(m_mesh_vertices.size()) });
+					if (iter.second)
+					{
+						m_mesh_vertices.push_back(vert);
+					}
+					face.vertIndex[v] = iter.first->second;
+				}
 			}
 		}
-		
+
+		//Group the faces into material batches
+		buildMeshBatches();
+		computeBounds();
+		buildMeshClusters();
+
+		//Load throughput
+		{
+			const auto ingest_end = std::chrono::high_resolution_clock::now();
+			const double parse_ms = std::chrono::duration<double, std::milli>(ingest_beg - parse_beg).count();
+			const double ingest_ms = std::chrono::duration<double, std::milli>(ingest_end - ingest_beg).count();
+			const double total_ms = parse_ms + ingest_ms;
+			std::cerr << "Loaded " << filename << ": " << m_mesh_faces.size() << " triangles in " << total_ms
+				<< " ms (parsing " << parse_ms << " ms, ingestion " << ingest_ms << " ms), "
+				<< (total_ms > 0.0 ? m_mesh_faces.size() / total_ms * 1e-3 : 0.0) << " M triangles/s" << std::endl;
+		}
+
+		//Note: failing to write the cache (e.g. a read-only directory) only costs the next start
+		TRMeshCache::write(filename, *this, matTextureNames);
 	}
 
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include "glm/glm.hpp"
 
 #include "TRShadingState.h"
+#include "TRRenderContext.h"
 
 namespace TinyRenderer
 {
@@ -30,14 +31,18 @@ namespace TinyRenderer
 		}
 	};
 
-	class TRMeshFace final
+	//A unique combination of the attribute indices, i.e. a vertex of the post-transform cache
+	class TRMeshVertex final
 	{
 	public:
-		unsigned int vposIndex[3];
-		unsigned int vnorIndex[3];
-		unsigned int vtexIndex[3];
+		unsigned int vposIndex;
+		unsigned int vnorIndex;
+		unsigned int vtexIndex;
+	};
 
-		//Per face material
+	class TRMaterial final
+	{
+	public:
 		int diffuseMapTexId = -1;
 		int specularMapTexId = -1;
 		int normalMapTexId = -1;
@@ -47,32 +52,86 @@ namespace TinyRenderer
 		glm::vec3 kS = glm::vec3(0.0f);//Specular coefficient
 		glm::vec3 kE = glm::vec3(0.0f);//Emission
 		float shininess = 1.0f;		   //Specular highlight exponment
+	};
+
+	class TRMeshFace final
+	{
+	public:
+		unsigned int vposIndex[3];
+		unsigned int vnorIndex[3];
+		unsigned int vtexIndex[3];
+		unsigned int vertIndex[3];//Index into the unique vertices of the mesh
+
+		//Index into the material table of the mesh
+		unsigned int materialId = 0;
 
 		//TBN matrix
 		glm::vec3 tangent;
 		glm::vec3 bitangent;
 	};
 
+	//A run of faces sharing the same material, the shading state is bound once per batch
+	class TRMeshBatch final
+	{
+	public:
+		unsigned int materialId;
+		unsigned int firstFace;
+		unsigned int numFaces;
+	};
+
+	//A group of neighbouring faces facing alike, culled as a whole before the vertex shading
+	class TRMeshCluster final
+	{
+	public:
+		unsigned int firstFace;//Index into the cluster faces of the mesh
+		unsigned int numFaces;
+		glm::vec4 boundingSphere;//Object space center and radius
+		glm::vec3 coneAxis;      //Average direction of the face normals
+		float coneCutoff;        //Sine of the widest angle between a normal and the axis, 1 if never facing away
+	};
+
 	class TRDrawableMesh
 	{
 	public:
 
 		typedef std::shared_ptr<TRDrawableMesh> ptr;
 
+		//Note: the texture ids of the materials are references into the texture cache of the render
+		//      context (the default one if none is given), acquired by loading or copying and
+		//      released by clear() or destruction.
 		TRDrawableMesh() = default;
-		~TRDrawableMesh() = default;
+		~TRDrawableMesh();
 		
-		TRDrawableMesh(const std::string &filename);
-		TRDrawableMesh(const TRDrawableMesh& mesh)
-			: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_faces(mesh.m_mesh_faces) {}
+		TRDrawableMesh(const std::string &filename, TRRenderContext::ptr context = nullptr);
+		TRDrawableMesh(const TRDrawableMesh& mesh);
 		TRDrawableMesh& operator=(const TRDrawableMesh& mesh);
 
+		//Note: the processed mesh is cached in a binary file next to the OBJ file (see TRMeshCache),
+		//      which is loaded instead of parsing the OBJ file as long as the OBJ file is unchanged.
 		void loadMeshFromFile(const std::string &filename);
 
 		TRVertexAttrib& getVerticesAttrib() { return m_vertices_attrib; }
+		std::vector<TRMeshVertex>& getMeshVertices() { return m_mesh_vertices; }
 		std::vector<TRMeshFace>& getMeshFaces() { return m_mesh_faces; }
 		const TRVertexAttrib& getVerticesAttrib() const { return m_vertices_attrib; }
+		const std::vector<TRMeshVertex>& getMeshVertices() const { return m_mesh_vertices; }
 		const std::vector<TRMeshFace>& getMeshFaces() const { return m_mesh_faces; }
+		const std::vector<TRMaterial>& getMeshMaterials() const { return m_mesh_materials; }
+		const std::vector<TRMeshBatch>& getMeshBatches() const { return m_mesh_batches; }
+		const std::vector<TRMeshCluster>& getMeshClusters() const { return m_mesh_clusters; }
+		const std::vector<unsigned int>& getClusterFaces() const { return m_cluster_faces; }
+
+		//Sort the faces by material and rebuild the batches, call it after modifying the faces
+		void buildMeshBatches();
+
+		//Object space bounding volumes of the vertex positions, call it after modifying the positions
+		void computeBounds();
+
+		//Group the faces into clusters with their culling bounds, call it after modifying the faces
+		void buildMeshClusters();
+		const glm::vec3& getBoundingBoxMin() const { return m_bounding_box_min; }
+		const glm::vec3& getBoundingBoxMax() const { return m_bounding_box_max; }
+		const glm::vec4& getBoundingSphere() const { return m_bounding_sphere; }//Center and radius
 
 		void clear();
 
@@ -90,10 +149,29 @@ namespace TinyRenderer
 		TRDepthWriteMode getDepthwriteMode() const { return m_drawing_config.depthwriteMode; }
 		const glm::mat4& getModelMatrix() const { return m_drawing_config.modelMatrix; }
 		TRLightingMode getLightingMode() const { return m_drawing_config.lightingMode; }
+		const TRRenderContext::ptr &getRenderContext() const { return m_context; }
+
+	protected:
+		//Elements per job of the parallel OBJ ingestion
+		enum { m_load_chunk_size = 4096 };
+		//Faces per cluster at most: smaller clusters have narrower normal cones, but cost more culling tests
+		enum { m_cluster_size = 64 };
+
+		void retainTextures();
+		void releaseTextures();
 
 	protected:
 		TRVertexAttrib m_vertices_attrib;
+		std::vector<TRMeshVertex> m_mesh_vertices;//Shaded once per frame, shared by the faces
 		std::vector<TRMeshFace> m_mesh_faces;
+		std::vector<TRMaterial> m_mesh_materials;
+		std::vector<TRMeshBatch> m_mesh_batches;
+		std::vector<TRMeshCluster> m_mesh_clusters;
+		std::vector<unsigned int> m_cluster_faces;//Face indices grouped by cluster
+		glm::vec3 m_bounding_box_min = glm::vec3(0.0f);
+		glm::vec3 m_bounding_box_max = glm::vec3(0.0f);
+		glm::vec4 m_bounding_sphere = glm::vec4(0.0f);
+		TRRenderContext::ptr m_context = TRRenderContext::getDefault();
 
 		//Configuration
 		struct DrawableConfig
@@ -106,6 +184,8 @@ namespace TinyRenderer
 			glm::mat4 modelMatrix = glm::mat4(1.0f);
 		};
 		DrawableConfig m_drawing_config;
+
+		friend class TRMeshCache;
 	};
 
 }
@@ -1,21 +1,102 @@
 #include "TRFrameBuffer.h"
+#include "TRSimd.h"
 
 #include <cmath>
+#include <cstring>
 #include <algorithm>
+
 namespace TinyRenderer
 {
-	TRFrameBuffer::TRFrameBuffer(int width, int height)
-		: m_channel(4), m_width(width), m_height(height)
+	// Fill count 32-bit values (RGBA8 colors or float depths) starting from dst
+	static void fillRow32(void *dst, unsigned int value, unsigned int count)
+	{
+		unsigned char *ptr = static_cast<unsigned char*>(dst);
+		unsigned int i = 0;
+#ifdef TR_HAS_SSE2
+		const __m128i value4 = _mm_set1_epi32(static_cast<int>(value));
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(ptr + i * 4), value4);
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			std::memcpy(ptr + i * 4, &value, 4);
+		}
+	}
+
+	// Average the samples of count pixels from src (samples RGBA8 colors per pixel) to dst
+	static void resolveRow(const unsigned char *src, unsigned char *dst, unsigned int count, unsigned int samples)
+	{
+		unsigned int i = 0;
+#ifdef TR_HAS_SSE2
+		// The 4 samples of a pixel fill a register: widen to 16 bits and add the halves,
+		// then two pixels are summed up by one more add and 4 pixels are packed at once
+		if (samples == 4)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i round = _mm_set1_epi16(2);
+			auto sumPair = [&](const unsigned char *pixels) -> __m128i
+			{
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + 16));
+				const __m128i sa = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero));
+				const __m128i sb = _mm_add_epi16(_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero));
+				const __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(sa, sb), _mm_unpackhi_epi64(sa, sb));
+				return _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+			};
+			for (; i + 4 <= count; i += 4)
+			{
+				const __m128i lo = sumPair(src + i * 16);
+				const __m128i hi = sumPair(src + i * 16 + 32);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_packus_epi16(lo, hi));
+			}
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			for (unsigned int c = 0; c < 4; ++c)
+			{
+				unsigned int sum = samples / 2;
+				for (unsigned int s = 0; s < samples; ++s)
+				{
+					sum += src[(i * samples + s) * 4 + c];
+				}
+				dst[i * 4 + c] = static_cast<unsigned char>(sum / samples);
+			}
+		}
+	}
+
+	TRFrameBuffer::TRFrameBuffer(int width, int height, int samples)
+		: m_width(width), m_height(height), m_channel(4), m_samples(std::max(samples, 1))
 	{
-		m_depthBuffer.resize(m_width * m_height, 1.0f);
-		m_colorBuffer.resize(m_width * m_height * m_channel, 255);
+		m_depthBuffer.resize(m_width * m_height * m_samples, 1.0f);
+		m_colorBuffer.resize(m_width * m_height * m_samples * m_channel, 255);
+		if (m_samples > 1)
+		{
+			m_resolveBuffer.resize(m_width * m_height * m_channel, 255);
+		}
+
+		// Hi-Z pyramid
+		m_hizBlocksX = (m_width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+		m_hizBlocksY = (m_height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+		m_hizTilesX = (m_width + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+		m_hizTilesY = (m_height + HIZ_TILE_SIZE - 1) / HIZ_TILE_SIZE;
+		m_hizBlocks.resize(m_hizBlocksX * m_hizBlocksY, HiZCell{ 1.0f, 1.0f, false });
+		m_hizTiles.resize(m_hizTilesX * m_hizTilesY, HiZCell{ 1.0f, 1.0f, false });
+
+		// The buffers are initialized, nothing is pending
+		m_tileFlags.resize(m_hizTilesX * m_hizTilesY, 0);
+		m_clearColor = 0xFFFFFFFFu;
 	}
 
-	float TRFrameBuffer::readDepth(const unsigned int &x, const unsigned int &y) const
+	float TRFrameBuffer::readDepth(const unsigned int &x, const unsigned int &y, unsigned int sample) const
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return 0.0f;
-		return m_depthBuffer[y*m_width + x];
+		if (m_tileFlags[(y / HIZ_TILE_SIZE) * m_hizTilesX + x / HIZ_TILE_SIZE] & TILE_DEPTH_PENDING)
+			return 1.0f;
+		return m_depthBuffer[(y*m_width + x) * m_samples + sample];
 	}
 
 	void TRFrameBuffer::clear(const glm::vec4 &color)
@@ -25,42 +106,335 @@ namespace TinyRenderer
 		unsigned char blue = static_cast<unsigned char>(255 * color.z);
 		unsigned char alpha = static_cast<unsigned char>(255 * color.w);
 
-		for (unsigned int row = 0; row < m_height; ++row)
+		const unsigned char rgba[4] = { red, green, blue, alpha };
+		unsigned int clearColor;
+		std::memcpy(&clearColor, rgba, 4);
+
+		// The touched tiles have to be cleared again, the others only if the color changes
+		// Note: the pending planes of the tiles never touched since then stay pending
+		for (auto &flags : m_tileFlags)
+		{
+			unsigned char pending = flags & (TILE_COLOR_PENDING | TILE_DEPTH_PENDING);
+			if (flags & TILE_TOUCHED)
+				pending = TILE_COLOR_PENDING | TILE_DEPTH_PENDING;
+			if (clearColor != m_clearColor)
+				pending |= TILE_COLOR_PENDING;
+			flags = pending;
+		}
+		m_clearColor = clearColor;
+
+		std::fill(m_hizBlocks.begin(), m_hizBlocks.end(), HiZCell{ 1.0f, 1.0f, false });
+		std::fill(m_hizTiles.begin(), m_hizTiles.end(), HiZCell{ 1.0f, 1.0f, false });
+	}
+
+	void TRFrameBuffer::touchTile(int tx, int ty)
+	{
+		unsigned char &flags = m_tileFlags[ty * m_hizTilesX + tx];
+		const unsigned int x0 = tx * HIZ_TILE_SIZE, y0 = ty * HIZ_TILE_SIZE;
+		const unsigned int x1 = std::min(x0 + HIZ_TILE_SIZE, m_width);
+		const unsigned int y1 = std::min(y0 + HIZ_TILE_SIZE, m_height);
+		if (flags & TILE_COLOR_PENDING)
+		{
+			for (unsigned int y = y0; y < y1; ++y)
+			{
+				fillRow32(&m_colorBuffer[(y * m_width + x0) * m_samples * m_channel], m_clearColor, (x1 - x0) * m_samples);
+			}
+		}
+		if (flags & TILE_DEPTH_PENDING)
+		{
+			const float one = 1.0f;
+			unsigned int depthBits;
+			std::memcpy(&depthBits, &one, 4);
+			for (unsigned int y = y0; y < y1; ++y)
+			{
+				fillRow32(&m_depthBuffer[(y * m_width + x0) * m_samples], depthBits, (x1 - x0) * m_samples);
+			}
+		}
+		flags = TILE_TOUCHED;
+	}
+
+	unsigned char *TRFrameBuffer::getColorBuffer()
+	{
+		// A clear without any rendering since then must not show the previous frame
+		for (int ty = 0; ty < m_hizTilesY; ++ty)
+		{
+			for (int tx = 0; tx < m_hizTilesX; ++tx)
+			{
+				if (m_tileFlags[ty * m_hizTilesX + tx] & TILE_COLOR_PENDING)
+				{
+					resolve(tx * HIZ_TILE_SIZE, ty * HIZ_TILE_SIZE, (tx + 1) * HIZ_TILE_SIZE - 1, (ty + 1) * HIZ_TILE_SIZE - 1);
+				}
+			}
+		}
+		return m_samples > 1 ? m_resolveBuffer.data() : m_colorBuffer.data();
+	}
+
+	void TRFrameBuffer::resolve(int x0, int y0, int x1, int y1)
+	{
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		x1 = std::min(x1, (int)m_width - 1);
+		y1 = std::min(y1, (int)m_height - 1);
+
+		for (int ty = y0 / HIZ_TILE_SIZE; ty <= y1 / HIZ_TILE_SIZE; ++ty)
 		{
-			for (unsigned int col = 0; col < m_width; ++col)
+			for (int tx = x0 / HIZ_TILE_SIZE; tx <= x1 / HIZ_TILE_SIZE; ++tx)
 			{
-				m_depthBuffer[row * m_width + col] = 1.0f;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 0] = red;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 1] = green;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 2] = blue;
-				m_colorBuffer[row * m_width * m_channel + col * m_channel + 3] = alpha;
+				unsigned char &flags = m_tileFlags[ty * m_hizTilesX + tx];
+				const unsigned int px0 = tx * HIZ_TILE_SIZE, py0 = ty * HIZ_TILE_SIZE;
+				const unsigned int px1 = std::min(px0 + HIZ_TILE_SIZE, m_width);
+				const unsigned int py1 = std::min(py0 + HIZ_TILE_SIZE, m_height);
+				if (flags & TILE_COLOR_PENDING)
+				{
+					// Not written since the clear, every sample has the clear color
+					// Note: the samples stay pending with multisampling, only the result is filled
+					std::vector<unsigned char> &target = (m_samples > 1) ? m_resolveBuffer : m_colorBuffer;
+					for (unsigned int y = py0; y < py1; ++y)
+					{
+						fillRow32(&target[(y * m_width + px0) * m_channel], m_clearColor, px1 - px0);
+					}
+					if (m_samples == 1)
+						flags &= ~TILE_COLOR_PENDING;
+				}
+				else if (m_samples > 1)
+				{
+					for (unsigned int y = py0; y < py1; ++y)
+					{
+						resolveRow(&m_colorBuffer[(y * m_width + px0) * m_samples * m_channel],
+							&m_resolveBuffer[(y * m_width + px0) * m_channel], px1 - px0, m_samples);
+					}
+				}
 			}
 		}
 	}
 
-	void TRFrameBuffer::writeDepth(const unsigned int &x, const unsigned int &y, const float &value)
+	void TRFrameBuffer::writeDepth(const unsigned int &x, const unsigned int &y, const float &value, unsigned int sample)
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return;
-		unsigned int index = y * m_width + x;
+		resolveTile(x, y);
+		unsigned int index = (y * m_width + x) * m_samples + sample;
+		float oldValue = m_depthBuffer[index];
 		m_depthBuffer[index] = value;
+		updateHiZ(x, y, oldValue, value);
 	}
 
-	void TRFrameBuffer::writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color)
+	void TRFrameBuffer::writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color, unsigned int sampleMask)
 	{
 		if (x < 0 || x >= m_width || y < 0 || y >= m_height)
 			return;
+		resolveTile(x, y);
 
 		// Clamping in case overflow
 		unsigned char red = static_cast<unsigned char>(color.x * 255);
 		unsigned char green = static_cast<unsigned char>(color.y * 255);
 		unsigned char blue = static_cast<unsigned char>(color.z * 255);
 		unsigned char alpha = static_cast<unsigned char>(std::min(255 * color.w, 255.0f));
-		unsigned int index = y * m_width*m_channel + x * m_channel;
-		m_colorBuffer[index + 0] = red;
-		m_colorBuffer[index + 1] = green;
-		m_colorBuffer[index + 2] = blue;
-		m_colorBuffer[index + 3] = alpha;
+		unsigned int index = (y * m_width + x) * m_samples * m_channel;
+		for (unsigned int s = 0; s < m_samples; ++s, index += m_channel)
+		{
+			if ((sampleMask & (1u << s)) == 0)
+				continue;
+			m_colorBuffer[index + 0] = red;
+			m_colorBuffer[index + 1] = green;
+			m_colorBuffer[index + 2] = blue;
+			m_colorBuffer[index + 3] = alpha;
+		}
+	}
+
+	unsigned int TRFrameBuffer::testDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask) const
+	{
+		if (x >= m_width || y >= m_height)
+			return 0;
+		const bool pending = (m_tileFlags[(y / HIZ_TILE_SIZE) * m_hizTilesX + x / HIZ_TILE_SIZE] & TILE_DEPTH_PENDING) != 0;
+		const float *stored = &m_depthBuffer[(y * m_width + x) * m_samples];
+		unsigned int passed = 0;
+		for (unsigned int s = 0; s < m_samples; ++s)
+		{
+			if ((sampleMask & (1u << s)) && (pending ? 1.0f : stored[s]) > depth[s])
+				passed |= (1u << s);
+		}
+		return passed;
+	}
+
+	void TRFrameBuffer::writeDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask)
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		resolveTile(x, y);
+		float *stored = &m_depthBuffer[(y * m_width + x) * m_samples];
+		for (unsigned int s = 0; s < m_samples; ++s)
+		{
+			if ((sampleMask & (1u << s)) == 0)
+				continue;
+			float oldValue = stored[s];
+			stored[s] = depth[s];
+			updateHiZ(x, y, oldValue, depth[s]);
+		}
+	}
+
+	void TRFrameBuffer::allocateGBuffer()
+	{
+		m_surfaces.resize(m_width * m_height);
+		m_surfaceStates.assign(m_width * m_height, SURFACE_EMPTY);
+	}
+
+	void TRFrameBuffer::swapGBuffer(TRFrameBuffer &other)
+	{
+		m_surfaces.swap(other.m_surfaces);
+		m_surfaceStates.swap(other.m_surfaceStates);
+	}
+
+	void TRFrameBuffer::clearSurfaces(int x0, int y0, int x1, int y1)
+	{
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		x1 = std::min(x1, (int)m_width - 1);
+		y1 = std::min(y1, (int)m_height - 1);
+		for (int y = y0; y <= y1; ++y)
+		{
+			std::fill(m_surfaceStates.begin() + y * m_width + x0, m_surfaceStates.begin() + y * m_width + x1 + 1, 
+				static_cast<unsigned char>(SURFACE_EMPTY));
+		}
+	}
+
+	void TRFrameBuffer::writeSurface(const unsigned int &x, const unsigned int &y, const TRSurface &surface)
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		m_surfaces[y * m_width + x] = surface;
+		m_surfaceStates[y * m_width + x] = SURFACE_LIT;
+	}
+
+	void TRFrameBuffer::writeSurfaceColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color)
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		m_surfaces[y * m_width + x].emission = glm::vec3(color);
+		m_surfaces[y * m_width + x].alpha = color.w;
+		m_surfaceStates[y * m_width + x] = SURFACE_COLOR;
+	}
+
+	unsigned int TRFrameBuffer::matchDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask) const
+	{
+		if (x >= m_width || y >= m_height)
+			return 0;
+		const bool pending = (m_tileFlags[(y / HIZ_TILE_SIZE) * m_hizTilesX + x / HIZ_TILE_SIZE] & TILE_DEPTH_PENDING) != 0;
+		const float *stored = &m_depthBuffer[(y * m_width + x) * m_samples];
+		unsigned int passed = 0;
+		for (unsigned int s = 0; s < m_samples; ++s)
+		{
+			if ((sampleMask & (1u << s)) && (pending ? 1.0f : stored[s]) == depth[s])
+				passed |= (1u << s);
+		}
+		return passed;
+	}
+
+	bool TRFrameBuffer::isOccluded(int x0, int y0, int x1, int y1, float depth)
+	{
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		x1 = std::min(x1, (int)m_width - 1);
+		y1 = std::min(y1, (int)m_height - 1);
+
+		// Coarse level first, then the 8x8 blocks of the tiles that are not hidden entirely
+		for (int ty = y0 / HIZ_TILE_SIZE; ty <= y1 / HIZ_TILE_SIZE; ++ty)
+		{
+			for (int tx = x0 / HIZ_TILE_SIZE; tx <= x1 / HIZ_TILE_SIZE; ++tx)
+			{
+				if (getTileMaxDepth(tx, ty) <= depth)
+					continue;
+
+				int bx0 = std::max(x0, tx * HIZ_TILE_SIZE) / HIZ_BLOCK_SIZE;
+				int by0 = std::max(y0, ty * HIZ_TILE_SIZE) / HIZ_BLOCK_SIZE;
+				int bx1 = std::min(x1, (tx + 1) * HIZ_TILE_SIZE - 1) / HIZ_BLOCK_SIZE;
+				int by1 = std::min(y1, (ty + 1) * HIZ_TILE_SIZE - 1) / HIZ_BLOCK_SIZE;
+				for (int by = by0; by <= by1; ++by)
+				{
+					for (int bx = bx0; bx <= bx1; ++bx)
+					{
+						if (getBlockMaxDepth(bx, by) > depth)
+							return false;
+					}
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void TRFrameBuffer::updateHiZ(unsigned int x, unsigned int y, float oldValue, float newValue)
+	{
+		HiZCell &block = m_hizBlocks[(y / HIZ_BLOCK_SIZE) * m_hizBlocksX + x / HIZ_BLOCK_SIZE];
+		HiZCell &tile = m_hizTiles[(y / HIZ_TILE_SIZE) * m_hizTilesX + x / HIZ_TILE_SIZE];
+
+		block.minDepth = std::min(block.minDepth, newValue);
+		tile.minDepth = std::min(tile.minDepth, newValue);
+
+		if (newValue > block.maxDepth)
+		{
+			block.maxDepth = newValue;
+			tile.maxDepth = std::max(tile.maxDepth, newValue);
+		}
+		else if (newValue < oldValue && oldValue == block.maxDepth)
+		{
+			// The farthest depth might have been overwritten, refresh it on the next query
+			block.dirty = true;
+			tile.dirty = true;
+		}
+	}
+
+	float TRFrameBuffer::getBlockMaxDepth(int bx, int by)
+	{
+		HiZCell &block = m_hizBlocks[by * m_hizBlocksX + bx];
+		if (block.dirty)
+		{
+			unsigned int x0 = bx * HIZ_BLOCK_SIZE, y0 = by * HIZ_BLOCK_SIZE;
+			unsigned int x1 = std::min(x0 + HIZ_BLOCK_SIZE, m_width);
+			unsigned int y1 = std::min(y0 + HIZ_BLOCK_SIZE, m_height);
+			float minDepth = m_depthBuffer[(y0 * m_width + x0) * m_samples];
+			float maxDepth = minDepth;
+			for (unsigned int y = y0; y < y1; ++y)
+			{
+				// The samples of the block pixels are contiguous in the row
+				const float *row = &m_depthBuffer[(y * m_width + x0) * m_samples];
+				for (unsigned int i = 0; i < (x1 - x0) * m_samples; ++i)
+				{
+					minDepth = std::min(minDepth, row[i]);
+					maxDepth = std::max(maxDepth, row[i]);
+				}
+			}
+			block.minDepth = minDepth;
+			block.maxDepth = maxDepth;
+			block.dirty = false;
+		}
+		return block.maxDepth;
+	}
+
+	float TRFrameBuffer::getTileMaxDepth(int tx, int ty)
+	{
+		HiZCell &tile = m_hizTiles[ty * m_hizTilesX + tx];
+		if (tile.dirty)
+		{
+			constexpr int blocksPerTile = HIZ_TILE_SIZE / HIZ_BLOCK_SIZE;
+			int bx0 = tx * blocksPerTile, by0 = ty * blocksPerTile;
+			int bx1 = std::min(bx0 + blocksPerTile, m_hizBlocksX);
+			int by1 = std::min(by0 + blocksPerTile, m_hizBlocksY);
+			float minDepth = m_hizBlocks[by0 * m_hizBlocksX + bx0].minDepth;
+			float maxDepth = getBlockMaxDepth(bx0, by0);
+			for (int by = by0; by < by1; ++by)
+			{
+				for (int bx = bx0; bx < bx1; ++bx)
+				{
+					maxDepth = std::max(maxDepth, getBlockMaxDepth(bx, by));
+					minDepth = std::min(minDepth, m_hizBlocks[by * m_hizBlocksX + bx].minDepth);
+				}
+			}
+			tile.minDepth = minDepth;
+			tile.maxDepth = maxDepth;
+			tile.dirty = false;
+		}
+		return tile.maxDepth;
 	}
 
 }
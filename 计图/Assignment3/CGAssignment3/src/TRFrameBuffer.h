@@ -4,6 +4,7 @@
 #include <memory>
 
 #include "glm/glm.hpp"
+#include "TRShadingState.h"
 
 namespace TinyRenderer
 {
@@ -19,24 +20,118 @@ namespace TinyRenderer
 		typedef std::shared_ptr<TRFrameBuffer> ptr;
 
 		// ctor/dtor.
-		TRFrameBuffer(int width, int height);
+		// Note: with samples > 1 (TR_MSAA_SAMPLES) every pixel stores that many depth and color
+		//       samples, which resolve() averages into the final color.
+		TRFrameBuffer(int width, int height, int samples = 1);
 		~TRFrameBuffer() = default;
 
+		// Fast clear: only the clear values are recorded, and every HIZ_TILE_SIZE tile is
+		// filled on its first write (or on resolve). The tiles nobody wrote to since the
+		// last clear with the same color are left alone, they already hold the values.
 		void clear(const glm::vec4 &color);
 
+		// Resolve the pending clear of the tile containing pixel (x, y), call it before
+		// writing to a tile from many pixels (the writes do it lazily otherwise).
+		void resolveTile(unsigned int x, unsigned int y)
+		{
+			unsigned char flags = m_tileFlags[(y / HIZ_TILE_SIZE) * m_hizTilesX + x / HIZ_TILE_SIZE];
+			if (flags != TILE_TOUCHED)
+				touchTile(x / HIZ_TILE_SIZE, y / HIZ_TILE_SIZE);
+		}
+
+		// Write the final RGBA8 color of the tiles overlapping [x0,x1]*[y0,y1] to the color
+		// buffer: the pending clear color, or the average of the samples with multisampling.
+		// Call it once the tiles are rendered, the renderer does it at the end of the tile pass.
+		void resolve(int x0, int y0, int x1, int y1);
+		void resolve() { resolve(0, 0, m_width - 1, m_height - 1); }
+
 		// Getter.
 		int getWidth()const { return m_width; }
 		int getHeight()const { return m_height; }
-		unsigned char *getColorBuffer() { return m_colorBuffer.data(); }
+		int getSampleCount()const { return m_samples; }
+		// Note: the tiles whose clear is still pending get the clear color first
+		unsigned char *getColorBuffer();
+
+		float readDepth(const unsigned int &x, const unsigned int &y, unsigned int sample = 0) const;
+		void writeDepth(const unsigned int &x, const unsigned int &y, const float &value, unsigned int sample = 0);
+		// Write the color to the samples in sampleMask (bit s for sample s)
+		void writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color, unsigned int sampleMask = ~0u);
+
+		// Depth of the samples of a pixel at once, depth[s] belongs to sample s:
+		// return the samples in sampleMask storing a depth > depth[s], and write those in sampleMask
+		unsigned int testDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask) const;
+		void writeDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask);
+		// Return the samples in sampleMask storing exactly depth[s], the test of the shading pass after a depth prepass
+		unsigned int matchDepthSamples(const unsigned int &x, const unsigned int &y, const float *depth, unsigned int sampleMask) const;
 
-		float readDepth(const unsigned int &x, const unsigned int &y) const;
-		void writeDepth(const unsigned int &x, const unsigned int &y, const float &value);
-		void writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color);
+		// G-buffer of the deferred shading: the surface of the visible fragment of every pixel,
+		// allocated on demand and left alone by clear(). swapGBuffer moves it between frame
+		// buffers, so the renderer keeps it with the frame being drawn and relights what's unchanged.
+		// Note: SURFACE_COLOR pixels store their final color in the emission, only SURFACE_LIT are lit.
+		enum SurfaceState { SURFACE_EMPTY, SURFACE_COLOR, SURFACE_LIT };
+		bool hasGBuffer() const { return !m_surfaces.empty(); }
+		void allocateGBuffer();
+		void swapGBuffer(TRFrameBuffer &other);
+		void clearSurfaces(int x0, int y0, int x1, int y1);
+		void writeSurface(const unsigned int &x, const unsigned int &y, const TRSurface &surface);
+		void writeSurfaceColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color);
+		SurfaceState getSurfaceState(unsigned int x, unsigned int y) const { return static_cast<SurfaceState>(m_surfaceStates[y * m_width + x]); }
+		const TRSurface &getSurface(unsigned int x, unsigned int y) const { return m_surfaces[y * m_width + x]; }
+
+		// Hierarchical-Z occlusion query.
+		// Return true if every sample in [x0,x1]*[y0,y1] already stores a depth <= depth,
+		// i.e. anything not nearer than depth is hidden there by the existing geometry.
+		// Note: the query and the depth writes touch only the pyramid cells overlapping
+		//       the given pixels, so threads working on disjoint HIZ_TILE_SIZE aligned
+		//       regions never share any cell.
+		bool isOccluded(int x0, int y0, int x1, int y1, float depth);
+
+		// Hi-Z pyramid layout: level 0 stores 8x8 pixel blocks, level 1 stores 64x64 pixel tiles.
+		enum { HIZ_BLOCK_SIZE = 8, HIZ_TILE_SIZE = 64 };
+
+	private:
+		// Lazy clear state of a tile
+		enum TileFlag
+		{
+			TILE_COLOR_PENDING = 1,  // color should be filled with the clear color
+			TILE_DEPTH_PENDING = 2,  // depth should be filled with 1.0f
+			TILE_TOUCHED = 4         // written since the last clear
+		};
+
+		void touchTile(int tx, int ty);
+
+		// Hi-Z cell of the min/max depth pyramid
+		struct HiZCell
+		{
+			float minDepth;
+			float maxDepth;
+			bool dirty;     // maxDepth might be too large and should be recomputed
+		};
+
+		void updateHiZ(unsigned int x, unsigned int y, float oldValue, float newValue);
+		float getBlockMaxDepth(int bx, int by);
+		float getTileMaxDepth(int tx, int ty);
 
 	private:
 		std::vector<float> m_depthBuffer;          // Z-buffer
 		std::vector<unsigned char> m_colorBuffer;   // Color buffer
 		unsigned int m_width, m_height, m_channel;  // Viewport
+
+		// Multisampling: the samples of a pixel are stored next to each other in both buffers
+		unsigned int m_samples;
+		std::vector<unsigned char> m_resolveBuffer; // Averaged color of the samples
+
+		std::vector<HiZCell> m_hizBlocks;           // Hi-Z level 0
+		std::vector<HiZCell> m_hizTiles;            // Hi-Z level 1
+		int m_hizBlocksX, m_hizBlocksY;
+		int m_hizTilesX, m_hizTilesY;
+
+		std::vector<unsigned char> m_tileFlags;     // TileFlag of the HIZ_TILE_SIZE tiles
+		unsigned int m_clearColor;                  // RGBA8 clear color in memory order
+
+		// G-buffer
+		std::vector<TRSurface> m_surfaces;
+		std::vector<unsigned char> m_surfaceStates; // SurfaceState
 	};
 }
 
@@ -0,0 +1,384 @@
+#include "TRMeshCache.h"
+
+#include "TRDrawableMesh.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+namespace TinyRenderer
+{
+	namespace
+	{
+		//Read-only memory mapping of a whole file, data() is nullptr if it fails
+		class TRMappedFile final
+		{
+		public:
+			explicit TRMappedFile(const std::string &path);
+			~TRMappedFile();
+
+			TRMappedFile(const TRMappedFile&) = delete;
+			TRMappedFile& operator=(const TRMappedFile&) = delete;
+
+			const unsigned char *data() const { return m_data; }
+			size_t size() const { return m_size; }
+
+		private:
+			const unsigned char *m_data = nullptr;
+			size_t m_size = 0;
+#ifdef _WIN32
+			HANDLE m_file = INVALID_HANDLE_VALUE;
+			HANDLE m_mapping = nullptr;
+#endif
+		};
+
+#ifdef _WIN32
+		TRMappedFile::TRMappedFile(const std::string &path)
+		{
+			m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE)
+				return;
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+				return;
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_mapping == nullptr)
+				return;
+			m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+			m_size = (m_data != nullptr) ? static_cast<size_t>(size.QuadPart) : 0;
+		}
+
+		TRMappedFile::~TRMappedFile()
+		{
+			if (m_data != nullptr)
+				UnmapViewOfFile(m_data);
+			if (m_mapping != nullptr)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+		}
+#else
+		TRMappedFile::TRMappedFile(const std::string &path)
+		{
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+			{
+				void *addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+				if (addr != MAP_FAILED)
+				{
+					m_data = static_cast<const unsigned char*>(addr);
+					m_size = static_cast<size_t>(st.st_size);
+				}
+			}
+			//Note: the mapping stays valid after closing the descriptor
+			close(fd);
+		}
+
+		TRMappedFile::~TRMappedFile()
+		{
+			if (m_data != nullptr)
+				munmap(const_cast<unsigned char*>(m_data), m_size);
+		}
+#endif
+
+		//Sections of the cache file, every section is an array aligned to 16 bytes
+		enum MeshCacheSection
+		{
+			SECTION_POSITIONS,
+			SECTION_COLORS,
+			SECTION_TEXCOORDS,
+			SECTION_NORMALS,
+			SECTION_VERTICES,
+			SECTION_FACES,
+			SECTION_MATERIALS,
+			SECTION_BATCHES,
+			SECTION_STRINGS,
+			NUM_SECTIONS
+		};
+
+		struct MeshCacheHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t elementSize[NUM_SECTIONS];//Detects the layout changes of the structures
+			uint64_t sourceSize;
+			int64_t sourceMTime;
+			uint64_t sourceHash;
+			uint64_t offset[NUM_SECTIONS];
+			uint64_t count[NUM_SECTIONS];
+		};
+
+		//Texture names are (offset, length) into the string section, length 0 means no texture
+		struct MeshCacheMaterial
+		{
+			float kA[3], kD[3], kS[3], kE[3];
+			float shininess;
+			uint32_t texName[4][2];
+		};
+
+		const char s_magic[8] = { 'T', 'R', 'M', 'E', 'S', 'H', '\0', '\0' };
+
+		//Bump it whenever the meaning of the cached data changes
+		const uint32_t s_version = 1;
+
+		const uint32_t s_element_size[NUM_SECTIONS] = {
+			sizeof(glm::vec4), sizeof(glm::vec4), sizeof(glm::vec2), sizeof(glm::vec3),
+			sizeof(TRMeshVertex), sizeof(TRMeshFace), sizeof(MeshCacheMaterial), sizeof(TRMeshBatch), 1 };
+
+		bool statFile(const std::string &path, uint64_t &size, int64_t &mtime)
+		{
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0)
+				return false;
+			size = static_cast<uint64_t>(st.st_size);
+			mtime = static_cast<int64_t>(st.st_mtime);
+			return true;
+		}
+
+		//FNV-1a
+		uint64_t hashFile(const std::string &path)
+		{
+			TRMappedFile file(path);
+			uint64_t hash = 14695981039346656037ull;
+			for (size_t i = 0; i < file.size(); ++i)
+			{
+				hash = (hash ^ file.data()[i]) * 1099511628211ull;
+			}
+			return hash;
+		}
+
+		template<typename T>
+		void copySection(const TRMappedFile &file, const MeshCacheHeader &header, int section, std::vector<T> &out)
+		{
+			out.resize(static_cast<size_t>(header.count[section]));
+			if (!out.empty())
+				std::memcpy(out.data(), file.data() + header.offset[section], out.size() * sizeof(T));
+		}
+	}
+
+	//----------------------------------------------TRMeshCache----------------------------------------------
+
+	std::string TRMeshCache::getCachePath(const std::string &objPath)
+	{
+		return objPath + ".trmesh";
+	}
+
+	bool TRMeshCache::read(const std::string &objPath, const std::string &baseDir, TRDrawableMesh &mesh)
+	{
+		TRMappedFile file(getCachePath(objPath));
+		if (file.data() == nullptr || file.size() < sizeof(MeshCacheHeader))
+			return false;
+
+		MeshCacheHeader header;
+		std::memcpy(&header, file.data(), sizeof(header));
+		if (std::memcmp(header.magic, s_magic, sizeof(s_magic)) != 0 || header.version != s_version)
+			return false;
+		for (int s = 0; s < NUM_SECTIONS; ++s)
+		{
+			if (header.elementSize[s] != s_element_size[s] || header.offset[s] > file.size() ||
+				header.count[s] > (file.size() - header.offset[s]) / s_element_size[s])
+				return false;
+		}
+
+		//The source must be unchanged, the content hash is the fallback of a touched file
+		uint64_t source_size;
+		int64_t source_mtime;
+		if (!statFile(objPath, source_size, source_mtime) || source_size != header.sourceSize)
+			return false;
+		if (source_mtime != header.sourceMTime && hashFile(objPath) != header.sourceHash)
+			return false;
+
+		//Materials, the texture names are validated before anything is loaded
+		const char *strings = reinterpret_cast<const char*>(file.data() + header.offset[SECTION_STRINGS]);
+		std::vector<MeshCacheMaterial> records;
+		copySection(file, header, SECTION_MATERIALS, records);
+		for (const auto &record : records)
+		{
+			for (int t = 0; t < 4; ++t)
+			{
+				if (static_cast<uint64_t>(record.texName[t][0]) + record.texName[t][1] > header.count[SECTION_STRINGS])
+					return false;
+			}
+		}
+
+		copySection(file, header, SECTION_POSITIONS, mesh.m_vertices_attrib.vpositions);
+		copySection(file, header, SECTION_COLORS, mesh.m_vertices_attrib.vcolors);
+		copySection(file, header, SECTION_TEXCOORDS, mesh.m_vertices_attrib.vtexcoords);
+		copySection(file, header, SECTION_NORMALS, mesh.m_vertices_attrib.vnormals);
+		copySection(file, header, SECTION_VERTICES, mesh.m_mesh_vertices);
+		copySection(file, header, SECTION_FACES, mesh.m_mesh_faces);
+		copySection(file, header, SECTION_BATCHES, mesh.m_mesh_batches);
+
+		//The indices are used unchecked by the renderer, a corrupt file must not get through
+		if (!validateIndices(mesh, records.size()))
+		{
+			mesh.m_vertices_attrib.clear();
+			std::vector<TRMeshVertex>().swap(mesh.m_mesh_vertices);
+			std::vector<TRMeshFace>().swap(mesh.m_mesh_faces);
+			std::vector<TRMeshBatch>().swap(mesh.m_mesh_batches);
+			return false;
+		}
+
+		auto loadTexture = [&](const uint32_t name[2]) -> int
+		{
+			if (name[1] == 0)
+				return -1;
+			return mesh.m_context->loadTexture2D(baseDir + std::string(strings + name[0], name[1]),
+				TRTextureWarpMode::TR_REPEAT, TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR);
+		};
+
+		mesh.m_mesh_materials.resize(records.size());
+		for (size_t m = 0; m < records.size(); ++m)
+		{
+			const MeshCacheMaterial &record = records[m];
+			TRMaterial &material = mesh.m_mesh_materials[m];
+			material.kA = glm::vec3(record.kA[0], record.kA[1], record.kA[2]);
+			material.kD = glm::vec3(record.kD[0], record.kD[1], record.kD[2]);
+			material.kS = glm::vec3(record.kS[0], record.kS[1], record.kS[2]);
+			material.kE = glm::vec3(record.kE[0], record.kE[1], record.kE[2]);
+			material.shininess = record.shininess;
+			material.diffuseMapTexId = loadTexture(record.texName[0]);
+			material.specularMapTexId = loadTexture(record.texName[1]);
+			material.normalMapTexId = loadTexture(record.texName[2]);
+			material.glowMapTexId = loadTexture(record.texName[3]);
+		}
+
+		return true;
+	}
+
+	bool TRMeshCache::validateIndices(const TRDrawableMesh &mesh, size_t num_materials)
+	{
+		const size_t num_positions = mesh.m_vertices_attrib.vpositions.size();
+		const size_t num_normals = mesh.m_vertices_attrib.vnormals.size();
+		const size_t num_texcoords = mesh.m_vertices_attrib.vtexcoords.size();
+		if (mesh.m_vertices_attrib.vcolors.size() != num_positions)
+			return false;
+		for (const auto &vert : mesh.m_mesh_vertices)
+		{
+			if (vert.vposIndex >= num_positions || vert.vnorIndex >= num_normals || vert.vtexIndex >= num_texcoords)
+				return false;
+		}
+		for (const auto &face : mesh.m_mesh_faces)
+		{
+			for (int v = 0; v < 3; ++v)
+			{
+				if (face.vposIndex[v] >= num_positions || face.vnorIndex[v] >= num_normals ||
+					face.vtexIndex[v] >= num_texcoords || face.vertIndex[v] >= mesh.m_mesh_vertices.size())
+					return false;
+			}
+			if (face.materialId >= num_materials)
+				return false;
+		}
+		for (const auto &batch : mesh.m_mesh_batches)
+		{
+			if (batch.materialId >= num_materials ||
+				static_cast<uint64_t>(batch.firstFace) + batch.numFaces > mesh.m_mesh_faces.size())
+				return false;
+		}
+		return true;
+	}
+
+	bool TRMeshCache::write(const std::string &objPath, const TRDrawableMesh &mesh, const std::vector<std::string> &texNames)
+	{
+		MeshCacheHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, s_magic, sizeof(s_magic));
+		header.version = s_version;
+		std::memcpy(header.elementSize, s_element_size, sizeof(s_element_size));
+		if (!statFile(objPath, header.sourceSize, header.sourceMTime))
+			return false;
+		header.sourceHash = hashFile(objPath);
+
+		//Materials and their texture names
+		std::vector<MeshCacheMaterial> records(mesh.m_mesh_materials.size());
+		std::string strings;
+		for (size_t m = 0; m < records.size(); ++m)
+		{
+			const TRMaterial &material = mesh.m_mesh_materials[m];
+			MeshCacheMaterial &record = records[m];
+			std::memset(&record, 0, sizeof(record));
+			std::memcpy(record.kA, &material.kA[0], sizeof(record.kA));
+			std::memcpy(record.kD, &material.kD[0], sizeof(record.kD));
+			std::memcpy(record.kS, &material.kS[0], sizeof(record.kS));
+			std::memcpy(record.kE, &material.kE[0], sizeof(record.kE));
+			record.shininess = material.shininess;
+			for (int t = 0; t < 4; ++t)
+			{
+				const size_t index = m * 4 + t;
+				const std::string name = (index < texNames.size()) ? texNames[index] : std::string();
+				record.texName[t][0] = static_cast<uint32_t>(strings.size());
+				record.texName[t][1] = static_cast<uint32_t>(name.size());
+				strings += name;
+			}
+		}
+
+		//Section layout
+		const void *sections[NUM_SECTIONS] = {
+			mesh.m_vertices_attrib.vpositions.data(), mesh.m_vertices_attrib.vcolors.data(),
+			mesh.m_vertices_attrib.vtexcoords.data(), mesh.m_vertices_attrib.vnormals.data(),
+			mesh.m_mesh_vertices.data(), mesh.m_mesh_faces.data(), records.data(),
+			mesh.m_mesh_batches.data(), strings.data() };
+		header.count[SECTION_POSITIONS] = mesh.m_vertices_attrib.vpositions.size();
+		header.count[SECTION_COLORS] = mesh.m_vertices_attrib.vcolors.size();
+		header.count[SECTION_TEXCOORDS] = mesh.m_vertices_attrib.vtexcoords.size();
+		header.count[SECTION_NORMALS] = mesh.m_vertices_attrib.vnormals.size();
+		header.count[SECTION_VERTICES] = mesh.m_mesh_vertices.size();
+		header.count[SECTION_FACES] = mesh.m_mesh_faces.size();
+		header.count[SECTION_MATERIALS] = records.size();
+		header.count[SECTION_BATCHES] = mesh.m_mesh_batches.size();
+		header.count[SECTION_STRINGS] = strings.size();
+
+		auto align = [](uint64_t offset) -> uint64_t { return (offset + 15) & ~static_cast<uint64_t>(15); };
+		uint64_t offset = align(sizeof(header));
+		for (int s = 0; s < NUM_SECTIONS; ++s)
+		{
+			header.offset[s] = offset;
+			offset = align(offset + header.count[s] * s_element_size[s]);
+		}
+
+		//Write to a temporary file first, so that a crash never leaves a broken cache behind
+		const std::string path = getCachePath(objPath);
+		const std::string tmp_path = path + ".tmp";
+		FILE *fp = std::fopen(tmp_path.c_str(), "wb");
+		if (fp == nullptr)
+			return false;
+
+		static const char padding[16] = { 0 };
+		bool success = std::fwrite(&header, sizeof(header), 1, fp) == 1;
+		uint64_t written = sizeof(header);
+		for (int s = 0; s < NUM_SECTIONS && success; ++s)
+		{
+			const size_t bytes = static_cast<size_t>(header.count[s] * s_element_size[s]);
+			success = std::fwrite(padding, 1, static_cast<size_t>(header.offset[s] - written), fp) == header.offset[s] - written
+				&& (bytes == 0 || std::fwrite(sections[s], 1, bytes, fp) == bytes);
+			written = header.offset[s] + bytes;
+		}
+		success = (std::fclose(fp) == 0) && success;
+
+		if (success)
+		{
+			std::remove(path.c_str());
+			success = std::rename(tmp_path.c_str(), path.c_str()) == 0;
+		}
+		if (!success)
+			std::remove(tmp_path.c_str());
+		return success;
+	}
+}
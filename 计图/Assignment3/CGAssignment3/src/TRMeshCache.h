@@ -0,0 +1,42 @@
+#ifndef TRMESHCACHE_H
+#define TRMESHCACHE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace TinyRenderer
+{
+	class TRDrawableMesh;
+
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Binary cache of the processed mesh (attributes, unique vertices, faces with TBN,
+	 *                materials with their texture names and batches) next to the OBJ file as *.trmesh.
+	 *                The cache is memory-mapped and copied straight into the mesh, it is only used if
+	 *                the version and layout match and the OBJ is unchanged: same size, and same mtime
+	 *                or else same content hash.
+	 * @note          Only the OBJ file is checked, delete the cache after editing its MTL files.
+	 */
+	class TRMeshCache final
+	{
+	public:
+
+		//Cache file of the given OBJ file
+		static std::string getCachePath(const std::string &objPath);
+
+		//Fill the mesh from the cache of objPath, return false if there is no valid cache.
+		//The textures are loaded from baseDir + the texture names of the materials.
+		static bool read(const std::string &objPath, const std::string &baseDir, TRDrawableMesh &mesh);
+
+		//Write the cache of objPath, texNames holds 4 texture names per material of the mesh
+		//(diffuse, specular, normal, glow, empty if none). Return false if it can't be written.
+		static bool write(const std::string &objPath, const TRDrawableMesh &mesh, const std::vector<std::string> &texNames);
+
+	private:
+		//Whether all the indices of the mesh are in range
+		static bool validateIndices(const TRDrawableMesh &mesh, size_t num_materials);
+	};
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include "TRRasterKernel.h"
+#include "TRSimd.h"
+
+#ifdef TR_ARCH_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//AVX2 is compiled per function and enabled by runtime detection
+#if defined(TR_ARCH_X86) && (defined(__GNUC__) || defined(_MSC_VER))
+#define TR_KERNEL_HAS_AVX2
+#endif
+
+#if defined(__GNUC__)
+#define TR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TR_TARGET_AVX2
+#endif
+
+namespace TinyRenderer
+{
+	//----------------------------------------------Span kernels----------------------------------------------
+
+	static unsigned int spanKernelScalar(const int C[3], const int I[3], int count, float one_div_delta, float *bary)
+	{
+		unsigned int mask = 0;
+		int Cx1 = C[0], Cx2 = C[1], Cx3 = C[2];
+		for (int k = 0; k < count; ++k)
+		{
+			//Counter-clockwise winding order
+			if (Cx1 <= 0 && Cx2 <= 0 && Cx3 <= 0)
+			{
+				mask |= (1u << k);
+				bary[k + 0] = Cx2 * one_div_delta;
+				bary[k + 8] = Cx3 * one_div_delta;
+				bary[k + 16] = Cx1 * one_div_delta;
+			}
+			Cx1 += I[0]; Cx2 += I[1]; Cx3 += I[2];
+		}
+		return mask;
+	}
+
+#ifdef TR_HAS_SSE2
+	static unsigned int spanKernelSSE2(const int C[3], const int I[3], int count, float one_div_delta, float *bary)
+	{
+		//Note: SSE2 has no 32-bit multiplication, so the lane offsets are built by scalar code
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i step1 = _mm_setr_epi32(0, I[0], 2 * I[0], 3 * I[0]);
+		const __m128i step2 = _mm_setr_epi32(0, I[1], 2 * I[1], 3 * I[1]);
+		const __m128i step3 = _mm_setr_epi32(0, I[2], 2 * I[2], 3 * I[2]);
+		const __m128 scale = _mm_set1_ps(one_div_delta);
+
+		unsigned int mask = 0;
+		for (int base = 0; base < count; base += 4)
+		{
+			__m128i E1 = _mm_add_epi32(_mm_set1_epi32(C[0] + base * I[0]), step1);
+			__m128i E2 = _mm_add_epi32(_mm_set1_epi32(C[1] + base * I[1]), step2);
+			__m128i E3 = _mm_add_epi32(_mm_set1_epi32(C[2] + base * I[2]), step3);
+
+			//Outside if any of the edge values > 0
+			__m128i outside = _mm_or_si128(_mm_cmpgt_epi32(E1, zero),
+				_mm_or_si128(_mm_cmpgt_epi32(E2, zero), _mm_cmpgt_epi32(E3, zero)));
+			mask |= (~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xF) << base;
+
+			_mm_storeu_ps(bary + base + 0, _mm_mul_ps(_mm_cvtepi32_ps(E2), scale));
+			_mm_storeu_ps(bary + base + 8, _mm_mul_ps(_mm_cvtepi32_ps(E3), scale));
+			_mm_storeu_ps(bary + base + 16, _mm_mul_ps(_mm_cvtepi32_ps(E1), scale));
+		}
+		return mask & ((1u << count) - 1);
+	}
+#endif
+
+#ifdef TR_KERNEL_HAS_AVX2
+	TR_TARGET_AVX2 static unsigned int spanKernelAVX2(const int C[3], const int I[3], int count, float one_div_delta, float *bary)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256 scale = _mm256_set1_ps(one_div_delta);
+
+		__m256i E1 = _mm256_add_epi32(_mm256_set1_epi32(C[0]), _mm256_mullo_epi32(lane, _mm256_set1_epi32(I[0])));
+		__m256i E2 = _mm256_add_epi32(_mm256_set1_epi32(C[1]), _mm256_mullo_epi32(lane, _mm256_set1_epi32(I[1])));
+		__m256i E3 = _mm256_add_epi32(_mm256_set1_epi32(C[2]), _mm256_mullo_epi32(lane, _mm256_set1_epi32(I[2])));
+
+		//Outside if any of the edge values > 0
+		__m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(E1, zero),
+			_mm256_or_si256(_mm256_cmpgt_epi32(E2, zero), _mm256_cmpgt_epi32(E3, zero)));
+		unsigned int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & ((1u << count) - 1);
+
+		_mm256_storeu_ps(bary + 0, _mm256_mul_ps(_mm256_cvtepi32_ps(E2), scale));
+		_mm256_storeu_ps(bary + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(E3), scale));
+		_mm256_storeu_ps(bary + 16, _mm256_mul_ps(_mm256_cvtepi32_ps(E1), scale));
+		return mask;
+	}
+#endif
+
+	//----------------------------------------------CPU detection----------------------------------------------
+
+	static bool detectAVX2()
+	{
+#if defined(TR_KERNEL_HAS_AVX2) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		//AVX and OS support for saving the ymm registers
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+			return false;
+		if ((_xgetbv(0) & 0x6) != 0x6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(TR_KERNEL_HAS_AVX2)
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#else
+		return false;
+#endif
+	}
+
+	static bool cpuSupportsAVX2()
+	{
+		static const bool supported = detectAVX2();
+		return supported;
+	}
+
+	static TRRasterKernel::KernelType detectBestKernel()
+	{
+		if (TRRasterKernel::isSupported(TRRasterKernel::TR_KERNEL_AVX2))
+			return TRRasterKernel::TR_KERNEL_AVX2;
+		if (TRRasterKernel::isSupported(TRRasterKernel::TR_KERNEL_SSE2))
+			return TRRasterKernel::TR_KERNEL_SSE2;
+		return TRRasterKernel::TR_KERNEL_SCALAR;
+	}
+
+	//----------------------------------------------TRRasterKernel----------------------------------------------
+
+	TRRasterKernel::KernelType TRRasterKernel::m_kernel_type = TRRasterKernel::TR_KERNEL_SCALAR;
+	TRRasterKernel::SpanFunc TRRasterKernel::m_span_func = &spanKernelScalar;
+
+	//Pick the fastest kernel at startup
+	static const bool s_kernel_selected = TRRasterKernel::setKernelType(detectBestKernel());
+
+	bool TRRasterKernel::isSupported(KernelType type)
+	{
+		switch (type)
+		{
+		case TR_KERNEL_SCALAR:
+			return true;
+		case TR_KERNEL_SSE2:
+#ifdef TR_HAS_SSE2
+			return true;
+#else
+			return false;
+#endif
+		case TR_KERNEL_AVX2:
+			return cpuSupportsAVX2();
+		default:
+			return false;
+		}
+	}
+
+	bool TRRasterKernel::setKernelType(KernelType type)
+	{
+		if (!isSupported(type))
+			return false;
+
+		switch (type)
+		{
+#ifdef TR_HAS_SSE2
+		case TR_KERNEL_SSE2:
+			m_span_func = &spanKernelSSE2;
+			break;
+#endif
+#ifdef TR_KERNEL_HAS_AVX2
+		case TR_KERNEL_AVX2:
+			m_span_func = &spanKernelAVX2;
+			break;
+#endif
+		default:
+			m_span_func = &spanKernelScalar;
+			break;
+		}
+		m_kernel_type = type;
+		return true;
+	}
+
+	const char *TRRasterKernel::getKernelName(KernelType type)
+	{
+		switch (type)
+		{
+		case TR_KERNEL_SCALAR: return "scalar";
+		case TR_KERNEL_SSE2: return "sse2";
+		case TR_KERNEL_AVX2: return "avx2";
+		default: return "unknown";
+		}
+	}
+}
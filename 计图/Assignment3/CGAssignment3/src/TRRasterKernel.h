@@ -0,0 +1,46 @@
+#ifndef TRRASTERKERNEL_H
+#define TRRASTERKERNEL_H
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Edge-function kernels for a row span of up to 8 pixels.
+	 *                Every kernel gives exactly the same result as the scalar one,
+	 *                the fastest kernel supported by the CPU is selected at runtime.
+	 */
+	class TRRasterKernel final
+	{
+	public:
+
+		enum KernelType
+		{
+			TR_KERNEL_SCALAR,
+			TR_KERNEL_SSE2,
+			TR_KERNEL_AVX2
+		};
+
+		enum { SPAN_WIDTH = 8 };
+
+		//Evaluate the edge functions of count (<= SPAN_WIDTH) consecutive pixels.
+		//C[i] is the i-th edge function value at the first pixel and I[i] its step along x.
+		//Return the coverage mask (bit k set if pixel k is inside: all the edge values <= 0),
+		//and the barycentric weights (C[1], C[2], C[0]) * one_div_delta of every pixel are
+		//written to bary[0..7], bary[8..15], bary[16..23] respectively.
+		typedef unsigned int(*SpanFunc)(const int C[3], const int I[3], int count, float one_div_delta, float *bary);
+
+		static SpanFunc getSpanFunc() { return m_span_func; }
+		static KernelType getKernelType() { return m_kernel_type; }
+
+		//Kernel selection, return false if the CPU doesn't support the given kernel
+		static bool isSupported(KernelType type);
+		static bool setKernelType(KernelType type);
+		static const char *getKernelName(KernelType type);
+
+	private:
+		static KernelType m_kernel_type;
+		static SpanFunc m_span_func;
+	};
+}
+
+#endif
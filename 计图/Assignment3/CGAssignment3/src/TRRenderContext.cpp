@@ -0,0 +1,95 @@
+#include "TRRenderContext.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	//----------------------------------------------TRRenderContext----------------------------------------------
+
+	TRRenderContext::ptr TRRenderContext::getDefault()
+	{
+		static TRRenderContext::ptr context = std::make_shared<TRRenderContext>();
+		return context;
+	}
+
+	int TRRenderContext::addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color)
+	{
+		m_point_lights.push_back(TRPointLight(pos, atten, color));
+		return m_point_lights.size() - 1;
+	}
+
+	int TRRenderContext::addSpotLight(glm::vec3 pos, glm::vec3 dir, glm::vec3 color, glm::vec3 atten, float cutOff, float outerCutOff)
+	{
+		m_spot_lights.push_back(TRSpotLight(pos, glm::normalize(dir), color, atten, cutOff, outerCutOff));
+		return m_spot_lights.size() - 1;
+	}
+
+	void TRRenderContext::updateLightConstants()
+	{
+		//Distance where the attenuated intensity falls below 1/256
+		//Note: the shader windows the attenuation to reach 0 at this radius, so the lights the
+		//      renderer culls by it would add nothing anyway and the radius needn't be conservative.
+		auto cutOffRadius = [](const glm::vec3 &color, const glm::vec3 &atten) -> float
+		{
+			const float threshold = 1.0f / 256.0f;
+			const float target = std::max(color.x, std::max(color.y, color.z)) / threshold - atten.x;
+			if (target <= 0.0f)
+				return 0.0f;
+			if (atten.z > 0.0f)
+				return (-atten.y + std::sqrt(atten.y * atten.y + 4.0f * atten.z * target)) / (2.0f * atten.z);
+			if (atten.y > 0.0f)
+				return target / atten.y;
+			return std::numeric_limits<float>::infinity();
+		};
+
+		m_light_constants.clear();
+
+		//The point lights aim at the centroid of the first three of them
+		glm::vec3 sum(0.0f, 0.0f, 0.0f);
+		const size_t num_aimed = std::min<size_t>(m_point_lights.size(), 3);
+		for (size_t i = 0; i < num_aimed; ++i)
+		{
+			sum += m_point_lights[i].lightPos;
+		}
+		const glm::vec3 average = sum / static_cast<float>(std::max<size_t>(num_aimed, 1));
+		const float cutOff = glm::cos(glm::radians(12.5f));
+		const float outerCutOff = glm::cos(glm::radians(17.5f));
+		for (const auto &light : m_point_lights)
+		{
+			LightConstants constants;
+			constants.lightPos = light.lightPos;
+			constants.lightColor = light.lightColor;
+			constants.attenuation = light.attenuation;
+			constants.radius = cutOffRadius(light.lightColor, light.attenuation);
+			if (average != light.lightPos)
+			{
+				constants.axis = glm::normalize(-(average - light.lightPos));
+				constants.cosOuterCutOff = outerCutOff;
+				constants.cutOffEpsilon = cutOff - outerCutOff;
+			}
+			else
+			{
+				//A lonely light has nothing to aim at, so it lights all around
+				constants.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+				constants.cosOuterCutOff = -2.0f;
+				constants.cutOffEpsilon = 1.0f;
+			}
+			m_light_constants.push_back(constants);
+		}
+
+		for (const auto &light : m_spot_lights)
+		{
+			LightConstants constants;
+			constants.lightPos = light.lightPos;
+			constants.lightColor = light.lightColor;
+			constants.attenuation = light.attenuation;
+			constants.radius = cutOffRadius(light.lightColor, light.attenuation);
+			constants.axis = -glm::normalize(light.lightDir);
+			constants.cosOuterCutOff = glm::cos(glm::radians(light.outerCutOff));
+			constants.cutOffEpsilon = std::max(glm::cos(glm::radians(light.cutOff)) - constants.cosOuterCutOff, 1e-4f);
+			m_light_constants.push_back(constants);
+		}
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef TRRENDERCONTEXT_H
+#define TRRENDERCONTEXT_H
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "glm/glm.hpp"
+
+#include "TRTexture2D.h"
+#include "TRTextureCache.h"
+#include "TRShadingState.h"
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         State shared by the renderers and meshes of a scene: the texture units, the lights
+	 *                and the viewer. The renderers shade with the context they are created with, and the
+	 *                meshes load their textures into theirs, so renderers with different contexts
+	 *                don't share anything and can render on different threads at the same time.
+	 * @note          A mesh must be drawn by renderers of its own context, the texture ids of its
+	 *                materials mean nothing to another context. Renderers sharing a context must not
+	 *                render concurrently, since the light constants are updated by every frame.
+	 */
+	class TRRenderContext final
+	{
+	public:
+		typedef std::shared_ptr<TRRenderContext> ptr;
+
+		//Context of the renderers and meshes created without one
+		static TRRenderContext::ptr getDefault();
+
+		//Textures
+		//Note: the texture units are deduplicated and reference counted, load/upload add a reference
+		//      to the returned id, and the textures released by all their users are freed by evict.
+		int uploadTexture2D(TRTexture2D::ptr tex) { return m_texture_units.upload(tex); }
+		int loadTexture2D(const std::string &filepath,
+			TRTextureWarpMode warpMode = TRTextureWarpMode::TR_REPEAT,
+			TRTextureFilterMode filterMode = TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR)
+		{
+			return m_texture_units.load(filepath, warpMode, filterMode);
+		}
+		void retainTexture2D(int index) { m_texture_units.retain(index); }
+		void releaseTexture2D(int index) { m_texture_units.release(index); }
+		size_t evictUnusedTextures2D() { return m_texture_units.evictUnused(); }
+		const TRTextureCache &getTextureCache() const { return m_texture_units; }
+		TRTexture2D::ptr getTexture2D(int index) const { return m_texture_units.getPtr(index); }
+
+		//Lights
+		int addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color);
+		TRPointLight &getPointLight(int index) { return m_point_lights[index]; }
+		//Note: cutOff and outerCutOff are the half angles of the cone in degrees
+		int addSpotLight(glm::vec3 pos, glm::vec3 dir, glm::vec3 color, glm::vec3 atten, float cutOff, float outerCutOff);
+		TRSpotLight &getSpotLight(int index) { return m_spot_lights[index]; }
+
+		//Viewer
+		void setViewerPos(const glm::vec3 &viewer) { m_viewer_pos = viewer; }
+		const glm::vec3 &getViewerPos() const { return m_viewer_pos; }
+
+		//Lighting constants of a light, computed once per frame (point lights first, then spot lights)
+		//Note: the point lights are lit as spot lights aiming at the centroid of the first three of them.
+		//      A light is windowed to fade out to 0 where its attenuated intensity falls below 1/256, so it
+		//      only lights the fragments within radius, which the renderer culls the lights of a tile by.
+		struct LightConstants
+		{
+			glm::vec3 lightPos;
+			glm::vec3 lightColor;
+			glm::vec3 attenuation;
+			glm::vec3 axis;            //Cone axis pointing to the light, cos(theta) = dot(L, axis)
+			float cosOuterCutOff;
+			float cutOffEpsilon;       //cos(cutOff) - cos(outerCutOff)
+			float radius;              //Cut off radius, infinity if the light never fades out enough
+		};
+		void updateLightConstants();
+		const std::vector<LightConstants> &getLightConstants() const { return m_light_constants; }
+
+	private:
+		TRTextureCache m_texture_units;
+		std::vector<TRPointLight> m_point_lights;
+		std::vector<TRSpotLight> m_spot_lights;
+		std::vector<LightConstants> m_light_constants;
+		glm::vec3 m_viewer_pos = glm::vec3(0.0f);
+	};
+}
+
+#endif
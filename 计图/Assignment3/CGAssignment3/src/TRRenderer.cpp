@@ -5,31 +5,113 @@
 #include "TRShadingPipeline.h"
 #include "TRUtils.h"
 #include <cmath>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <typeinfo>
+#include <algorithm>
 
 namespace TinyRenderer
 {
 
-	TRRenderer::TRRenderer(int width, int height)
-		: m_backBuffer(nullptr), m_frontBuffer(nullptr)
+	TRRenderer::TRRenderer(int width, int height, TRRenderContext::ptr context)
+		: m_context(context), m_backBuffer(nullptr), m_frontBuffer(nullptr)
 	{
+		if (m_context == nullptr)
+		{
+			m_context = TRRenderContext::getDefault();
+		}
+
 		//Double buffer to avoid flickering
 		m_backBuffer = std::make_shared<TRFrameBuffer>(width, height);
 		m_frontBuffer = std::make_shared<TRFrameBuffer>(width, height);
 
 		//Setup viewport matrix (ndc space -> screen space)
 		m_viewportMatrix = TRUtils::calcViewPortMatrix(width, height);
+		setGuardBand(m_guard_band_pixels);
+
+		//Screen tiles for binning
+		//Note: a tile must cover whole Hi-Z tiles, then threads never update the same Hi-Z cell
+		static_assert(m_tile_size % TRFrameBuffer::HIZ_TILE_SIZE == 0, "Tile size must be a multiple of the Hi-Z tile size");
+		m_num_tiles_x = (width + m_tile_size - 1) / m_tile_size;
+		m_num_tiles_y = (height + m_tile_size - 1) / m_tile_size;
+		m_tile_bins.resize(m_num_tiles_x * m_num_tiles_y);
+		m_tile_lights.resize(m_num_tiles_x * m_num_tiles_y);
+		m_tile_surface_keys.resize(m_num_tiles_x * m_num_tiles_y, 0ull);
+
+		if (TRPipelineStatistics::isEnabled())
+		{
+			m_overdraw.resize(width * height, 0);
+		}
+
+		m_thread_pool = std::make_shared<TRThreadPool>();
+	}
+
+	bool TRRenderer::setMultisampleMode(TRMultisampleMode mode)
+	{
+		const int samples = (mode == TRMultisampleMode::TR_MSAA_4X) ? TR_MSAA_SAMPLES : 1;
+		if (samples == m_backBuffer->getSampleCount())
+			return true;
+		const int width = m_backBuffer->getWidth(), height = m_backBuffer->getHeight();
+		if (samples > 1 && (width > m_msaa_guard_band_pixels || height > m_msaa_guard_band_pixels))
+		{
+			std::cerr << "The frame buffer is too large for multisampling: " << width << "x" << height << std::endl;
+			return false;
+		}
+		m_backBuffer = std::make_shared<TRFrameBuffer>(width, height, samples);
+		m_frontBuffer = std::make_shared<TRFrameBuffer>(width, height, samples);
+		setGuardBand(samples > 1 ? m_msaa_guard_band_pixels : m_guard_band_pixels);
+		return true;
+	}
+
+	void TRRenderer::setGuardBand(int pixels)
+	{
+		m_guard_band = glm::vec2(
+			2.0f * pixels / m_backBuffer->getWidth() - 1.0f,
+			2.0f * pixels / m_backBuffer->getHeight() - 1.0f);
+	}
+
+	int TRRenderer::getSubpixelUnits(TRPolygonMode mode) const
+	{
+		//Note: the wireframe is drawn in pixels by the Bresenham algorithm
+		return (mode == TRPolygonMode::TR_TRIANGLE_FILL && m_backBuffer->getSampleCount() > 1) ? TR_SAMPLE_UNITS : 1;
+	}
+
+	TRMultisampleMode TRRenderer::getMultisampleMode() const
+	{
+		return m_backBuffer->getSampleCount() > 1 ? TRMultisampleMode::TR_MSAA_4X : TRMultisampleMode::TR_MSAA_DISABLE;
+	}
+
+	void TRRenderer::setNumberOfThreads(int num)
+	{
+		m_thread_pool = std::make_shared<TRThreadPool>(num);
+	}
+
+	int TRRenderer::getNumberOfThreads() const
+	{
+		return m_thread_pool->getNumberOfThreads();
 	}
 
 
 
 	void TRRenderer::addDrawableMesh(TRDrawableMesh::ptr mesh)
 	{
+		//The texture ids of the mesh only mean something to its own context
+		if (mesh->getRenderContext() != m_context)
+		{
+			std::cerr << "The mesh is loaded into another render context, ignore it" << std::endl;
+			return;
+		}
 		m_drawableMeshes.push_back(mesh);
 	}
 
 	void TRRenderer::addDrawableMesh(const std::vector<TRDrawableMesh::ptr> &meshes)
 	{
-		m_drawableMeshes.insert(m_drawableMeshes.end(), meshes.begin(), meshes.end());
+		for (const auto &mesh : meshes)
+		{
+			addDrawableMesh(mesh);
+		}
 	}
 
 	void TRRenderer::unloadDrawableMesh()
@@ -67,9 +149,7 @@ namespace TinyRenderer
 
 	void TRRenderer::setViewerPos(const glm::vec3 &viewer)
 	{
-		if (m_shader_handler == nullptr)
-			return;
-		m_shader_handler->setViewerPos(viewer);
+		m_context->setViewerPos(viewer);
 	}
 
 	glm::mat4 TRRenderer::getMVPMatrix()
@@ -89,24 +169,22 @@ namespace TinyRenderer
 
 	int TRRenderer::addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color)
 	{
-		return TRShadingPipeline::addPointLight(pos, atten, color);
+		return m_context->addPointLight(pos, atten, color);
 	}
 	// TRRenderer.cpp ʵ addSpotLight 
 	int TRRenderer::addSpotLight(const glm::vec3& pos, const glm::vec3& direction, const glm::vec3& color,
 		const glm::vec3& attenuation, float cutOff, float outerCutOff)
 	{
-		TRSpotLight newSpotLight(pos, glm::normalize(direction), color, attenuation, cutOff, outerCutOff);
-		spotLights.push_back(newSpotLight);
-		return spotLights.size() - 1;  // ¹Դ
+		return m_context->addSpotLight(pos, direction, color, attenuation, cutOff, outerCutOff);  // ¹Դ
 	}
 	// TRRenderer.cpp ʵ getSpotLight 
 	TRSpotLight& TRRenderer::getSpotLight(int index)
 	{
-		return spotLights.at(index);  // ʹ at() Խ
+		return m_context->getSpotLight(index);
 	}
 	TRPointLight &TRRenderer::getPointLight(const int &index)
 	{
-		return TRShadingPipeline::getPointLight(index);
+		return m_context->getPointLight(index);
 	}
 
 	void TRRenderer::renderAllDrawableMeshes()
@@ -116,15 +194,63 @@ namespace TinyRenderer
 			m_shader_handler = std::make_shared<TRDefaultShadingPipeline>();
 		}
 		
-		//Load the matrices
+		//Load the matrices and the shading context
+		m_shader_handler->setRenderContext(m_context);
 		m_shader_handler->setModelMatrix(m_modelMatrix);
 		m_shader_handler->setViewProjectMatrix(m_projectMatrix * m_viewMatrix);
 
 		//Draw a mesh step by step
 		m_clip_cull_profile.m_num_cliped_triangles = 0;
 		m_clip_cull_profile.m_num_culled_triangles = 0;
-		std::vector<TRShadingPipeline::VertexData> rasterized_points;
-		rasterized_points.reserve(m_backBuffer->getWidth() * m_backBuffer->getHeight());
+
+		typedef std::chrono::high_resolution_clock Clock;
+		auto elapsed_ms = [](const Clock::time_point &beg, const Clock::time_point &end) -> double
+		{
+			return std::chrono::duration<double, std::milli>(end - beg).count();
+		};
+		m_frame_timings = FrameTimings();
+		m_statistics.reset();
+		TR_STAT(std::fill(m_overdraw.begin(), m_overdraw.end(), 0u));
+		const auto geometry_beg = Clock::now();
+
+		m_raster_triangles.clear();
+		for (auto &bin : m_tile_bins)
+		{
+			bin.clear();
+		}
+
+		//Lights of each tile
+		cullLights();
+
+		//Deferred shading: bring the G-buffer of the last frame along, the tiles whose triangles
+		//are still the same keep their surfaces. The forward frames leave it out of date.
+		m_deferred_frame = m_deferred_shading == TRDeferredShadingMode::TR_DEFERRED_SHADING_ENABLE
+			&& m_backBuffer->getSampleCount() == 1;
+		if (m_deferred_frame)
+		{
+			m_backBuffer->swapGBuffer(*m_frontBuffer);
+			if (!m_backBuffer->hasGBuffer())
+			{
+				m_backBuffer->allocateGBuffer();
+				std::fill(m_tile_surface_keys.begin(), m_tile_surface_keys.end(), 0ull);
+			}
+		}
+		else
+		{
+			std::fill(m_tile_surface_keys.begin(), m_tile_surface_keys.end(), 0ull);
+		}
+
+		//Make sure each thread has its own copy of the shader
+		int num_threads = m_thread_pool->getNumberOfThreads();
+		m_worker_statistics.assign(num_threads, TRPipelineStatistics());
+		m_worker_shaders.resize(num_threads);
+		for (int t = 0; t < num_threads; ++t)
+		{
+			m_worker_shaders[t] = m_shader_handler->clone();
+		}
+		selectKernels();
+
+		//Geometry stage: vertex shading, clipping, screen mapping and tile binning
 		for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
 		{
 			//Configuration
@@ -132,149 +258,656 @@ namespace TinyRenderer
 			TRCullFaceMode cullfaceMode = m_drawableMeshes[m]->getCullfaceMode();
 			TRDepthTestMode depthtestMode = m_drawableMeshes[m]->getDepthtestMode();
 			TRDepthWriteMode depthwriteMode = m_drawableMeshes[m]->getDepthwriteMode();
+			bool lightingEnable = m_drawableMeshes[m]->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE;
 			m_shader_handler->setModelMatrix(m_drawableMeshes[m]->getModelMatrix());
-			m_shader_handler->setLightingEnable(m_drawableMeshes[m]->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE);
+			for (auto &shader : m_worker_shaders)
+			{
+				shader->setModelMatrix(m_drawableMeshes[m]->getModelMatrix());
+			}
 
 			const auto& vertices = m_drawableMeshes[m]->getVerticesAttrib();
+			const auto& meshVertices = m_drawableMeshes[m]->getMeshVertices();
 			const auto& faces = m_drawableMeshes[m]->getMeshFaces();
-			for (size_t f = 0; f < faces.size(); ++f)
+			const auto& materials = m_drawableMeshes[m]->getMeshMaterials();
+			const auto& batches = m_drawableMeshes[m]->getMeshBatches();
+
+			//Frustum culling: the meshes out of sight are skipped as a whole,
+			//the ones in sight entirely need neither the outcodes nor the clipping
+			const BoundsVisibility visibility = classifyBounds(*m_drawableMeshes[m]);
+			if (visibility == BOUNDS_OUTSIDE)
 			{
-				//Setup the shading options
-				{
-					m_shader_handler->setAmbientCoef(faces[f].kA);
-					m_shader_handler->setDiffuseCoef(faces[f].kD);
-					m_shader_handler->setSpecularCoef(faces[f].kS);
-					m_shader_handler->setEmissionColor(faces[f].kE);
-					m_shader_handler->setDiffuseTexId(faces[f].diffuseMapTexId);
-					m_shader_handler->setSpecularTexId(faces[f].specularMapTexId);
-					m_shader_handler->setNormalTexId(faces[f].normalMapTexId);
-					m_shader_handler->setGlowTexId(faces[f].glowMapTexId);
-					m_shader_handler->setShininess(faces[f].shininess);
-					m_shader_handler->setTangent(faces[f].tangent);
-					m_shader_handler->setBitangent(faces[f].bitangent);
-				}
+				m_clip_cull_profile.m_num_cliped_triangles += static_cast<unsigned int>(faces.size());
+				continue;
+			}
+			const bool inside = visibility == BOUNDS_INSIDE;
 
-				//A triangle as primitive
-				TRShadingPipeline::VertexData v[3];
-				{
-					v[0].pos = vertices.vpositions[faces[f].vposIndex[0]];
-					v[0].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[0]]);
-					v[0].nor = vertices.vnormals[faces[f].vnorIndex[0]];
-					v[0].tex = vertices.vtexcoords[faces[f].vtexIndex[0]];
-
-					v[1].pos = vertices.vpositions[faces[f].vposIndex[1]];
-					v[1].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[1]]);
-					v[1].nor = vertices.vnormals[faces[f].vnorIndex[1]];
-					v[1].tex = vertices.vtexcoords[faces[f].vtexIndex[1]];
-
-					v[2].pos = vertices.vpositions[faces[f].vposIndex[2]];
-					v[2].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[2]]);
-					v[2].nor = vertices.vnormals[faces[f].vnorIndex[2]];
-					v[2].tex = vertices.vtexcoords[faces[f].vtexIndex[2]];
-				}
+			//Cluster culling: the clusters facing away or out of sight are rejected before any per-vertex work
+			const auto vertex_beg = Clock::now();
+			cullClusters(*m_drawableMeshes[m], inside, cullfaceMode);
+
+			//Vertex shader stage: every unique vertex of the visible clusters is shaded exactly once
+			//Note: the vertices don't depend on each other, so they are shaded in parallel
+			int num_vertices = static_cast<int>(m_visible_vertices.size());
+			int num_chunks = (num_vertices + m_vertex_chunk_size - 1) / m_vertex_chunk_size;
+			m_shaded_vertices.resize(meshVertices.size());
+			m_shaded_outcodes.resize(meshVertices.size());
+			m_thread_pool->parallelFor(0, num_chunks, [&](int chunk, int slot)
+			{
+				int last = std::min(num_vertices, (chunk + 1) * m_vertex_chunk_size);
+				const unsigned int *indices = m_visible_vertices.data();
+				(this->*m_vertex_kernel)(indices + chunk * m_vertex_chunk_size, indices + last, slot, vertices, meshVertices, !inside);
+			});
+			m_frame_timings.vertexStage += elapsed_ms(vertex_beg, Clock::now());
+			TR_STAT(m_statistics.verticesShaded += num_vertices);
 
-				//Vertex shader stage
-				std::vector<TRShadingPipeline::VertexData> clipped_vertices;
+			//Planes that must be clipped against for real, the rasterizer takes care of the others
+			const unsigned int clip_planes = (polygonMode == TRPolygonMode::TR_TRIANGLE_FILL)
+				? (CLIP_POS_Z | CLIP_NEG_Z | CLIP_W | GUARD_POS_X | GUARD_NEG_X | GUARD_POS_Y | GUARD_NEG_Y)
+				: (CLIP_POS_X | CLIP_NEG_X | CLIP_POS_Y | CLIP_NEG_Y | CLIP_POS_Z | CLIP_NEG_Z | CLIP_W);
+			const float spos_scale = static_cast<float>(getSubpixelUnits(polygonMode));
+
+			//Primitive assembly batch by batch, the faces of a batch share the same material
+			ClipPolygon polygon;
+			for (const auto &batch : batches)
+			{
+				const TRMaterial *material = &materials[batch.materialId];
+				for (size_t f = batch.firstFace; f < batch.firstFace + batch.numFaces; ++f)
 				{
-					//Vertex shader
+					//Culled with its cluster already
+					if (!m_face_marks[f])
+						continue;
+
+					const TRMeshFace &face = faces[f];
+					const unsigned int outcode0 = inside ? 0u : m_shaded_outcodes[face.vertIndex[0]];
+					const unsigned int outcode1 = inside ? 0u : m_shaded_outcodes[face.vertIndex[1]];
+					const unsigned int outcode2 = inside ? 0u : m_shaded_outcodes[face.vertIndex[2]];
+
+					//Totally outside: all the vertices are outside the same plane
+					if (outcode0 & outcode1 & outcode2)
 					{
-						m_shader_handler->vertexShader(v[0]);
-						m_shader_handler->vertexShader(v[1]);
-						m_shader_handler->vertexShader(v[2]);
+						++m_clip_cull_profile.m_num_cliped_triangles;
+						continue;
 					}
 
-					//Homogeneous space cliping
+					//A triangle as primitive, fetched from the post-transform vertices
 					{
-						clipped_vertices = clipingSutherlandHodgeman(v[0], v[1], v[2]);
-						if (clipped_vertices.empty())
-						{
-							++m_clip_cull_profile.m_num_cliped_triangles;
-							continue;
-						}
+						polygon.vertices[0] = m_shaded_vertices[face.vertIndex[0]];
+						polygon.vertices[1] = m_shaded_vertices[face.vertIndex[1]];
+						polygon.vertices[2] = m_shaded_vertices[face.vertIndex[2]];
+						polygon.size = 3;
+						m_shader_handler->setupTBN(face.tangent, face.bitangent, polygon.vertices);
+					}
+
+					//Homogeneous space cliping, only if some vertex crosses a plane to be clipped
+					const unsigned int crossed_planes = (outcode0 | outcode1 | outcode2) & clip_planes;
+					if (crossed_planes != 0 && !clipPolygon(polygon, crossed_planes))
+					{
+						++m_clip_cull_profile.m_num_cliped_triangles;
+						continue;
 					}
 
 					//Perspective division
-					for (auto &vert : clipped_vertices)
+					for (int i = 0; i < polygon.size; ++i)
 					{
 						//From clip space -> ndc space
+						auto &vert = polygon.vertices[i];
 						TRShadingPipeline::VertexData::prePerspCorrection(vert);
 						vert.cpos /= vert.cpos.w;
 					}
-				}
 
-				int num_verts = clipped_vertices.size();
-				for (int i = 0; i < num_verts - 2; ++i)
-				{
-					//Triangle assembly
-					TRShadingPipeline::VertexData vert[3] = {
-							clipped_vertices[0],
-							clipped_vertices[i + 1],
-							clipped_vertices[i + 2] };
+					for (int i = 0; i < polygon.size - 2; ++i)
+					{
+						//Triangle assembly
+						RasterTriangle tri;
+						tri.v[0] = polygon.vertices[0];
+						tri.v[1] = polygon.vertices[i + 1];
+						tri.v[2] = polygon.vertices[i + 2];
+						tri.material = material;
+						tri.polygonMode = polygonMode;
+						tri.depthtestMode = depthtestMode;
+						tri.depthwriteMode = depthwriteMode;
+						tri.lightingEnable = lightingEnable;
+						TR_STAT(++m_statistics.trianglesAssembled);
 
+						//Transform to screen space (subpixels with multisampling)
+						tri.v[0].spos = glm::ivec2(glm::vec2(m_viewportMatrix * tri.v[0].cpos) * spos_scale + glm::vec2(0.5f));
+						tri.v[1].spos = glm::ivec2(glm::vec2(m_viewportMatrix * tri.v[1].cpos) * spos_scale + glm::vec2(0.5f));
+						tri.v[2].spos = glm::ivec2(glm::vec2(m_viewportMatrix * tri.v[2].cpos) * spos_scale + glm::vec2(0.5f));
 
-					//Rasterization stage
-					{
-						//Transform to screen space & Rasterization
+						//Backface culling
+						if (isBackFacing(tri.v[0].spos, tri.v[1].spos, tri.v[2].spos, cullfaceMode))
 						{
-							vert[0].spos = glm::ivec2(m_viewportMatrix * vert[0].cpos + glm::vec4(0.5f));
-							vert[1].spos = glm::ivec2(m_viewportMatrix * vert[1].cpos + glm::vec4(0.5f));
-							vert[2].spos = glm::ivec2(m_viewportMatrix * vert[2].cpos + glm::vec4(0.5f));
-
-							//Backface culling
-							if (isBackFacing(vert[0].spos, vert[1].spos, vert[2].spos, cullfaceMode))
-							{
-								++m_clip_cull_profile.m_num_culled_triangles;
-								continue;
-							}
-
-							switch (polygonMode)
-							{
-								case TRPolygonMode::TR_TRIANGLE_FILL:
-									m_shader_handler->rasterize_fill_edge_function(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
-								case TRPolygonMode::TR_TRIANGLE_WIRE:
-									m_shader_handler->rasterize_wire(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
-							}
+							++m_clip_cull_profile.m_num_culled_triangles;
+							continue;
+						}
+
+						//Tile binning
+						if (!binTriangle(tri))
+						{
+							++m_clip_cull_profile.m_num_culled_triangles;
+							continue;
 						}
+						TR_STAT(++m_statistics.trianglesRasterized);
 					}
+				}
+			}
+
+		}
+
+		const auto raster_beg = Clock::now();
+		m_frame_timings.clipStage = elapsed_ms(geometry_beg, raster_beg) - m_frame_timings.vertexStage;
+
+		//Rasterization stage: each tile is owned by exactly one thread
+		m_thread_pool->parallelFor(0, static_cast<int>(m_tile_bins.size()),
+			[this](int tile, int slot) { rasterizeTile(tile, slot); });
+		m_frame_timings.rasterStage = elapsed_ms(raster_beg, Clock::now());
+		for (const auto &stats : m_worker_statistics)
+		{
+			m_statistics += stats;
+		}
+
+		//Swap double buffers
+		{
+			std::swap(m_backBuffer, m_frontBuffer);
+		}
+		
+	}
 
-					if (rasterized_points.empty())
+	void TRRenderer::cullLights()
+	{
+		for (auto &lights : m_tile_lights)
+		{
+			lights.clear();
+		}
+
+		m_context->updateLightConstants();
+		const auto &constants = m_context->getLightConstants();
+		const glm::mat4 view_project = m_projectMatrix * m_viewMatrix;
+		const int width = m_backBuffer->getWidth(), height = m_backBuffer->getHeight();
+		for (size_t i = 0; i < constants.size(); ++i)
+		{
+			const auto &light = constants[i];
+			if (light.radius <= 0.0f)
+				continue;
+
+			//Screen space bounds of the corners of the box around the light sphere
+			//Note: the box is in front of the eye if all of its corners are (w is the view depth),
+			//      then the projected corners bound it, otherwise it might cover the whole screen.
+			glm::vec2 screen_min(0.0f), screen_max(static_cast<float>(width - 1), static_cast<float>(height - 1));
+			if (!std::isinf(light.radius))
+			{
+				glm::vec2 corner_min(FLT_MAX), corner_max(-FLT_MAX);
+				int num_in_front = 0, num_behind = 0;
+				for (int c = 0; c < 8; ++c)
+				{
+					const glm::vec3 offset((c & 1) ? light.radius : -light.radius,
+						(c & 2) ? light.radius : -light.radius, (c & 4) ? light.radius : -light.radius);
+					glm::vec4 cpos = view_project * glm::vec4(light.lightPos + offset, 1.0f);
+					if (cpos.w < m_frustum_near_far.x)
 					{
-						++m_clip_cull_profile.m_num_culled_triangles;
+						++num_behind;
+						continue;
 					}
+					num_in_front += (cpos.w > m_frustum_near_far.y) ? 0 : 1;
+					const glm::vec4 spos = m_viewportMatrix * (cpos / cpos.w);
+					corner_min = glm::min(corner_min, glm::vec2(spos));
+					corner_max = glm::max(corner_max, glm::vec2(spos));
+				}
 
-					//Fragment shader & Depth testing
-					for (auto &point : rasterized_points)
+				//All behind the near plane or beyond the far plane
+				if (num_behind == 8 || (num_behind == 0 && num_in_front == 0))
+					continue;
+				if (num_behind == 0)
+				{
+					screen_min = glm::max(screen_min, corner_min);
+					screen_max = glm::min(screen_max, corner_max);
+				}
+			}
+			if (screen_min.x > screen_max.x || screen_min.y > screen_max.y)
+				continue;
+
+			const int tx0 = static_cast<int>(screen_min.x) / m_tile_size, tx1 = static_cast<int>(screen_max.x) / m_tile_size;
+			const int ty0 = static_cast<int>(screen_min.y) / m_tile_size, ty1 = static_cast<int>(screen_max.y) / m_tile_size;
+			for (int ty = ty0; ty <= ty1; ++ty)
+			{
+				for (int tx = tx0; tx <= tx1; ++tx)
+				{
+					m_tile_lights[ty * m_num_tiles_x + tx].push_back(static_cast<unsigned int>(i));
+				}
+			}
+		}
+	}
+
+	bool TRRenderer::binTriangle(const RasterTriangle &tri)
+	{
+		const glm::ivec2 &s0 = tri.v[0].spos;
+		const glm::ivec2 &s1 = tri.v[1].spos;
+		const glm::ivec2 &s2 = tri.v[2].spos;
+
+		//Degenerated to a line or a point
+		if (tri.polygonMode == TRPolygonMode::TR_TRIANGLE_FILL)
+		{
+			auto e1 = s1 - s0;
+			auto e2 = s2 - s0;
+			if (e1.x * e2.y - e1.y * e2.x == 0)
+				return false;
+		}
+
+		//Screen space bounding box
+		//Note: clamped to the screen in subpixels first, then the division rounds the right way
+		const int units = getSubpixelUnits(tri.polygonMode);
+		int min_x = std::max(std::min(s0.x, std::min(s1.x, s2.x)), 0);
+		int min_y = std::max(std::min(s0.y, std::min(s1.y, s2.y)), 0);
+		int max_x = std::min(std::max(s0.x, std::max(s1.x, s2.x)) + units - 1, m_backBuffer->getWidth() * units - 1);
+		int max_y = std::min(std::max(s0.y, std::max(s1.y, s2.y)) + units - 1, m_backBuffer->getHeight() * units - 1);
+		if (min_x > max_x || min_y > max_y)
+			return false;
+		min_x /= units; min_y /= units;
+		max_x /= units; max_y /= units;
+
+		unsigned int index = static_cast<unsigned int>(m_raster_triangles.size());
+		m_raster_triangles.push_back(tri);
+
+		//Note: triangles are appended in submission order, so every tile keeps the drawing order
+		for (int ty = min_y / m_tile_size; ty <= max_y / m_tile_size; ++ty)
+		{
+			for (int tx = min_x / m_tile_size; tx <= max_x / m_tile_size; ++tx)
+			{
+				m_tile_bins[ty * m_num_tiles_x + tx].push_back(index);
+			}
+		}
+
+		return true;
+	}
+
+	void TRRenderer::rasterizeTile(int tile, int slot)
+	{
+		//Tile region (inclusive)
+		const int tx = tile % m_num_tiles_x, ty = tile / m_num_tiles_x;
+		const glm::ivec4 region(
+			tx * m_tile_size,
+			ty * m_tile_size,
+			std::min((tx + 1) * m_tile_size, m_backBuffer->getWidth()) - 1,
+			std::min((ty + 1) * m_tile_size, m_backBuffer->getHeight()) - 1);
+
+		//Note: the tile is resolved to the final color right away, while its samples are in the cache
+		const auto &bin = m_tile_bins[tile];
+		if (bin.empty())
+		{
+			m_backBuffer->resolve(region.x, region.y, region.z, region.w);
+			return;
+		}
+
+		//Fill the pending clear once for the whole tile instead of checking it per pixel
+		for (int y = region.y; y <= region.w; y += TRFrameBuffer::HIZ_TILE_SIZE)
+		{
+			for (int x = region.x; x <= region.z; x += TRFrameBuffer::HIZ_TILE_SIZE)
+			{
+				m_backBuffer->resolveTile(x, y);
+			}
+		}
+
+		auto &shader = m_worker_shaders[slot];
+		shader->setLightList(&m_tile_lights[tile]);
+
+		//Deferred shading: the surfaces of the tile are still valid if the same triangles cover it
+		//Note: a tile with an empty bin keeps its key, since its G-buffer isn't touched either.
+		bool rasterize = true;
+		if (m_deferred_frame)
+		{
+			const unsigned long long key = computeTileKey(bin);
+			rasterize = (key == 0ull || key != m_tile_surface_keys[tile]);
+			m_tile_surface_keys[tile] = key;
+			if (rasterize)
+			{
+				m_backBuffer->clearSurfaces(region.x, region.y, region.z, region.w);
+			}
+		}
+
+		//Lay the nearest depth of the tile first, then the shading below only matches it
+		if (rasterize && m_depth_prepass == TRDepthPrepassMode::TR_DEPTH_PREPASS_ENABLE)
+		{
+			rasterizeDepth(bin.data(), bin.data() + bin.size(), region);
+		}
+
+		//Note: triangles of a batch are binned in a row, so the bin is drawn in runs of the same setting
+		for (size_t begin = 0, end = 0; rasterize && begin < bin.size(); begin = end)
+		{
+			const RasterTriangle &head = m_raster_triangles[bin[begin]];
+			for (end = begin + 1; end < bin.size(); ++end)
+			{
+				const RasterTriangle &tri = m_raster_triangles[bin[end]];
+				if (tri.material != head.material || tri.lightingEnable != head.lightingEnable)
+					break;
+			}
+
+			//Setup the shading options
+			shader->setAmbientCoef(head.material->kA);
+			shader->setDiffuseCoef(head.material->kD);
+			shader->setSpecularCoef(head.material->kS);
+			shader->setEmissionColor(head.material->kE);
+			shader->setDiffuseTexId(head.material->diffuseMapTexId);
+			shader->setSpecularTexId(head.material->specularMapTexId);
+			shader->setNormalTexId(head.material->normalMapTexId);
+			shader->setGlowTexId(head.material->glowMapTexId);
+			shader->setShininess(head.material->shininess);
+			shader->setLightingEnable(head.lightingEnable);
+
+			//Raster loop specialized for the features of the run
+			(this->*m_batch_kernels[shader->getFeatures()])(bin.data() + begin, bin.data() + end, region, slot);
+		}
+		if (m_deferred_frame)
+		{
+			(this->*m_light_kernel)(region, slot);
+		}
+		m_backBuffer->resolve(region.x, region.y, region.z, region.w);
+
+		//Note: the tile owns its pixels, and the texture counter belongs to the current thread
+#ifdef TR_ENABLE_STATISTICS
+		auto &stats = m_worker_statistics[slot];
+		for (int y = region.y; y <= region.w; ++y)
+		{
+			for (int x = region.x; x <= region.z; ++x)
+			{
+				stats.pixelsShaded += (m_overdraw[y * m_backBuffer->getWidth() + x] != 0);
+			}
+		}
+		stats.textureSamples += TRShadingPipeline::fetchTextureSampleCount();
+#endif
+	}
+
+	void TRRenderer::rasterizeDepth(const unsigned int *first, const unsigned int *last, const glm::ivec4 &region)
+	{
+		const unsigned int num_samples = m_backBuffer->getSampleCount();
+		for (; first != last; ++first)
+		{
+			const RasterTriangle &tri = m_raster_triangles[*first];
+			if (!isPrepassed(tri))
+				continue;
+
+			auto occluded = [&](int x0, int y0, int x1, int y1, float min_depth) -> bool
+			{
+				return m_backBuffer->isOccluded(x0, y0, x1, y1, min_depth);
+			};
+			auto depth_test = [&](int x, int y, const float *depth, unsigned int coverage) -> unsigned int
+			{
+				return m_backBuffer->testDepthSamples(x, y, depth, coverage);
+			};
+			auto depth_write = [&](TRShadingPipeline::VertexData &point, unsigned int samples, const float *depth)
+			{
+				m_backBuffer->writeDepthSamples(point.spos.x, point.spos.y, depth, samples);
+			};
+
+			//Note: no varyings, so the rasterizer skips the attributes interpolation
+			if (num_samples > 1)
+			{
+				TRShadingPipeline::rasterize_fill_edge_function<TR_MSAA_SAMPLES>(tri.v[0], tri.v[1], tri.v[2],
+					region, 0u, occluded, depth_test, depth_write);
+			}
+			else
+			{
+				TRShadingPipeline::rasterize_fill_edge_function<1>(tri.v[0], tri.v[1], tri.v[2],
+					region, 0u, occluded, depth_test, depth_write);
+			}
+		}
+	}
+
+	unsigned long long TRRenderer::computeTileKey(const std::vector<unsigned int> &bin) const
+	{
+		//FNV-1a over the raw bits of the triangles in drawing order, seeded with the shading pipeline type
+		unsigned long long key = 14695981039346656037ull;
+		auto hash = [&key](const void *data, size_t size)
+		{
+			const unsigned char *bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; ++i)
+			{
+				key = (key ^ bytes[i]) * 1099511628211ull;
+			}
+		};
+		hash(&m_batch_kernels, sizeof(m_batch_kernels));
+		for (unsigned int index : bin)
+		{
+			const RasterTriangle &tri = m_raster_triangles[index];
+			for (const auto &v : tri.v)
+			{
+				hash(&v.pos, sizeof(v.pos));
+				hash(&v.col, sizeof(v.col));
+				hash(&v.nor, sizeof(v.nor));
+				hash(&v.tex, sizeof(v.tex));
+				hash(&v.cpos, sizeof(v.cpos));
+				hash(&v.spos, sizeof(v.spos));
+				hash(&v.TBN, sizeof(v.TBN));
+			}
+			const TRMaterial &material = *tri.material;
+			const int modes[] = { tri.polygonMode, tri.depthtestMode, tri.depthwriteMode, tri.lightingEnable,
+				material.diffuseMapTexId, material.specularMapTexId, material.normalMapTexId, material.glowMapTexId };
+			hash(modes, sizeof(modes));
+			hash(&material.kA, sizeof(material.kA));
+			hash(&material.kD, sizeof(material.kD));
+			hash(&material.kS, sizeof(material.kS));
+			hash(&material.kE, sizeof(material.kE));
+			hash(&material.shininess, sizeof(material.shininess));
+		}
+		return key;
+	}
+
+	void TRRenderer::selectKernels()
+	{
+		//The built-in pipelines get their own kernels, the others go through the virtual shaders
+		//Note: the exact type is compared, a derived pipeline might override the shaders
+		const std::type_info &type = typeid(*m_shader_handler);
+		if (type == typeid(TRPhongShadingPipeline))
+			selectKernels<TRPhongShadingPipeline>(TRAllFeatures());
+		else if (type == typeid(TRTextureShadingPipeline))
+			selectKernels<TRTextureShadingPipeline>(TRAllFeatures());
+		else if (type == typeid(TRDefaultShadingPipeline))
+			selectKernels<TRDefaultShadingPipeline>(TRAllFeatures());
+		else
+			selectKernels<TRShadingPipeline>(TRAllFeatures());
+	}
+
+	template<typename Shader, unsigned int... Features>
+	void TRRenderer::selectKernels(TRFeatureList<Features...>)
+	{
+		//Only the features the shader cares about make different kernels
+		static const BatchKernel batch_kernels[] = {
+			&TRRenderer::rasterizeBatch<Shader, Features & Shader::m_shading_features>... };
+		m_vertex_kernel = &TRRenderer::shadeVertices<Shader>;
+		m_batch_kernels = batch_kernels;
+		m_light_kernel = &TRRenderer::lightTile<Shader>;
+	}
+
+	template<typename Shader>
+	void TRRenderer::shadeVertices(const unsigned int *first, const unsigned int *last, int slot,
+		const TRVertexAttrib &vertices, const std::vector<TRMeshVertex> &meshVertices, bool outcodes)
+	{
+		Shader &shader = static_cast<Shader&>(*m_worker_shaders[slot]);
+		for (; first != last; ++first)
+		{
+			const unsigned int i = *first;
+			const TRMeshVertex &index = meshVertices[i];
+			TRShadingPipeline::VertexData &vert = m_shaded_vertices[i];
+			vert.pos = vertices.vpositions[index.vposIndex];
+			vert.col = glm::vec3(vertices.vcolors[index.vposIndex]);
+			vert.nor = vertices.vnormals[index.vnorIndex];
+			vert.tex = vertices.vtexcoords[index.vtexIndex];
+			shader.shadeVertex(vert);
+			if (outcodes)
+				m_shaded_outcodes[i] = computeOutcode(vert.cpos);
+		}
+	}
+
+	template<typename Shader, unsigned int Features>
+	void TRRenderer::rasterizeBatch(const unsigned int *first, const unsigned int *last, const glm::ivec4 &region, int slot)
+	{
+		Shader &shader = static_cast<Shader&>(*m_worker_shaders[slot]);
+#ifdef TR_ENABLE_STATISTICS
+		auto &stats = m_worker_statistics[slot];
+#endif
+		const unsigned int varyings = shader.getVaryings();
+		const unsigned int num_samples = m_backBuffer->getSampleCount();
+
+		//Shade a fragment to the samples, or store its surface in the G-buffer for the lighting pass
+		auto shade = [&](const TRShadingPipeline::VertexData &point, unsigned int samples)
+		{
+			glm::vec4 fragColor;
+			if (m_deferred_frame)
+			{
+				if (Shader::m_deferred_lighting && (Features & TR_FEATURE_LIGHTING))
+				{
+					TRSurface surface;
+					shader.template shadeSurface<Features>(point, surface);
+					m_backBuffer->writeSurface(point.spos.x, point.spos.y, surface);
+					return;
+				}
+				shader.template shadeFragment<Features>(point, fragColor);
+				m_backBuffer->writeSurfaceColor(point.spos.x, point.spos.y, fragColor);
+				return;
+			}
+			shader.template shadeFragment<Features>(point, fragColor);
+			m_backBuffer->writeColor(point.spos.x, point.spos.y, fragColor, samples);
+		};
+
+		for (; first != last; ++first)
+		{
+			const RasterTriangle &tri = m_raster_triangles[*first];
+			//Note: the depth of the prepassed triangles is in place already, the visible samples match it exactly
+			const bool prepassed = isPrepassed(tri);
+
+			//Hierarchical-Z occlusion culling
+			auto occluded = [&](int x0, int y0, int x1, int y1, float min_depth) -> bool
+			{
+				return tri.depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
+					m_backBuffer->isOccluded(x0, y0, x1, y1, min_depth);
+			};
+
+			//Depth testing is done right inside the rasterization loop, per sample for the filling
+			auto depth_test_samples = [&](int x, int y, const float *depth, unsigned int coverage) -> unsigned int
+			{
+				TR_STAT(++stats.fragmentsGenerated);
+				if (tri.depthtestMode != TRDepthTestMode::TR_DEPTH_TEST_ENABLE)
+					return 0u;
+				if (prepassed)
+					return m_backBuffer->matchDepthSamples(x, y, depth, coverage);
+				return m_backBuffer->testDepthSamples(x, y, depth, coverage);
+			};
+
+			//Fragment shader for the pixels having samples that survive the depth testing
+			auto fragment_samples = [&](TRShadingPipeline::VertexData &point, unsigned int samples, const float *depth)
+			{
+				shade(point, samples);
+				if (prepassed)
+				{
+					//Nudge the shaded samples a bit nearer, so later fragments at the same depth don't match
+					//and the first one wins like without the prepass
+					float shaded[TR_MSAA_SAMPLES];
+					for (unsigned int s = 0; s < num_samples; ++s)
 					{
-						//Perspective correction after rasterization
-						TRShadingPipeline::VertexData::aftPrespCorrection(point);
-						if (depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
-							m_backBuffer->readDepth(point.spos.x, point.spos.y) > point.cpos.z)
-						{
-							glm::vec4 fragColor;
-							m_shader_handler->fragmentShader(point, fragColor);
-							m_backBuffer->writeColor(point.spos.x, point.spos.y, fragColor);
-							if (depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
-							{
-								m_backBuffer->writeDepth(point.spos.x, point.spos.y, point.cpos.z);
-							}
-						}
+						shaded[s] = std::nextafter(depth[s], -FLT_MAX);
 					}
+					m_backBuffer->writeDepthSamples(point.spos.x, point.spos.y, shaded, samples);
+				}
+				else if (tri.depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+				{
+					m_backBuffer->writeDepthSamples(point.spos.x, point.spos.y, depth, samples);
+				}
+				TR_STAT(++stats.fragmentsPassed);
+				TR_STAT(++m_overdraw[point.spos.y * m_backBuffer->getWidth() + point.spos.x]);
+			};
 
-					rasterized_points.clear();
+			//The lines cover whole pixels, i.e. all of their samples
+			auto depth_test = [&](int x, int y, float depth) -> bool
+			{
+				TR_STAT(++stats.fragmentsGenerated);
+				return tri.depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
+					m_backBuffer->readDepth(x, y) > depth;
+			};
+			auto fragment = [&](TRShadingPipeline::VertexData &point)
+			{
+				shade(point, ~0u);
+				if (tri.depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+				{
+					for (unsigned int s = 0; s < num_samples; ++s)
+					{
+						m_backBuffer->writeDepth(point.spos.x, point.spos.y, point.cpos.z, s);
+					}
 				}
+				TR_STAT(++stats.fragmentsPassed);
+				TR_STAT(++m_overdraw[point.spos.y * m_backBuffer->getWidth() + point.spos.x]);
+			};
+
+			//Rasterization inside the tile
+			switch (tri.polygonMode)
+			{
+				case TRPolygonMode::TR_TRIANGLE_FILL:
+					if (num_samples > 1)
+					{
+						TRShadingPipeline::rasterize_fill_edge_function<TR_MSAA_SAMPLES>(tri.v[0], tri.v[1], tri.v[2], 
+							region, varyings, occluded, depth_test_samples, fragment_samples);
+					}
+					else
+					{
+						TRShadingPipeline::rasterize_fill_edge_function<1>(tri.v[0], tri.v[1], tri.v[2], 
+							region, varyings, occluded, depth_test_samples, fragment_samples);
+					}
+					break;
+				case TRPolygonMode::TR_TRIANGLE_WIRE:
+					TRShadingPipeline::rasterize_wire(tri.v[0], tri.v[1], tri.v[2], region, 
+						varyings, depth_test, fragment);
+					break;
 			}
+		}
+	}
 
+	template<typename Shader>
+	void TRRenderer::lightTile(const glm::ivec4 &region, int slot)
+	{
+		Shader &shader = static_cast<Shader&>(*m_worker_shaders[slot]);
+		for (int y = region.y; y <= region.w; ++y)
+		{
+			for (int x = region.x; x <= region.z; ++x)
+			{
+				const TRFrameBuffer::SurfaceState state = m_backBuffer->getSurfaceState(x, y);
+				if (state == TRFrameBuffer::SURFACE_EMPTY)
+					continue;
+				const TRSurface &surface = m_backBuffer->getSurface(x, y);
+				glm::vec4 fragColor;
+				if (state == TRFrameBuffer::SURFACE_LIT)
+					shader.lightSurface(surface, fragColor);
+				else
+					fragColor = glm::vec4(surface.emission, surface.alpha);
+				m_backBuffer->writeColor(x, y, fragColor);
+			}
 		}
+	}
 
-		//Swap double buffers
+	bool TRRenderer::dumpOverdrawHeatmap(const std::string &filename) const
+	{
+		if (!TRPipelineStatistics::isEnabled())
+			return false;
+
+		FILE *fp = std::fopen(filename.c_str(), "wb");
+		if (fp == nullptr)
+			return false;
+
+		//Color ramp: 0 black, 1 blue, 2 cyan, 3 green, 4 yellow, 5 orange, 6 red, >= 7 white
+		static const unsigned char ramp[8][3] = {
+			{ 0, 0, 0 }, { 0, 0, 255 }, { 0, 255, 255 }, { 0, 255, 0 },
+			{ 255, 255, 0 }, { 255, 128, 0 }, { 255, 0, 0 }, { 255, 255, 255 } };
+
+		const int width = m_frontBuffer->getWidth(), height = m_frontBuffer->getHeight();
+		std::vector<unsigned char> image(width * height * 3);
+		for (int i = 0; i < width * height; ++i)
 		{
-			std::swap(m_backBuffer, m_frontBuffer);
+			const unsigned char *color = ramp[std::min(m_overdraw[i], 7u)];
+			image[i * 3 + 0] = color[0];
+			image[i * 3 + 1] = color[1];
+			image[i * 3 + 2] = color[2];
 		}
-		
+		std::fprintf(fp, "P6\n%d %d\n255\n", width, height);
+		std::fwrite(image.data(), 1, image.size(), fp);
+		std::fclose(fp);
+		return true;
 	}
 
 	unsigned char* TRRenderer::commitRenderedColorBuffer()
@@ -292,137 +925,221 @@ namespace TinyRenderer
 		return m_clip_cull_profile.m_num_culled_triangles;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman(
-		const TRShadingPipeline::VertexData &v0,
-		const TRShadingPipeline::VertexData &v1,
-		const TRShadingPipeline::VertexData &v2) const
+	unsigned int TRRenderer::computeOutcode(const glm::vec4 &cpos) const
 	{
-		//Clipping in the homogeneous clipping space
-		//Refs:
-		//https://fabiensanglard.net/polygon_codec/clippingdocument/Clipping.pdf
-		//https://fabiensanglard.net/polygon_codec/
-
-		//Optimization: complete outside or complete inside
-		//Note: in the following situations, we could return the answer without complicate cliping,
-		//      and this optimization should be very important.
+		unsigned int outcode = 0;
+		for (int plane = 0; plane < NUM_CLIP_PLANES; ++plane)
 		{
-			//Totally inside
-			if (isPointInsideInClipingFrustum(v0.cpos)
-				&& isPointInsideInClipingFrustum(v1.cpos)
-				&& isPointInsideInClipingFrustum(v2.cpos))
-			{
-				return { v0,v1,v2 };
-			}
-			//Totally outside
-			if (v0.cpos.w < m_frustum_near_far.x && v1.cpos.w < m_frustum_near_far.x && v2.cpos.w < m_frustum_near_far.x)
-				return{};
-			if (v0.cpos.w > m_frustum_near_far.y && v1.cpos.w > m_frustum_near_far.y && v2.cpos.w > m_frustum_near_far.y)
-				return{};
-			if (v0.cpos.x > v0.cpos.w && v1.cpos.x > v1.cpos.w && v2.cpos.x > v2.cpos.w)
-				return{};
-			if (v0.cpos.x <-v0.cpos.w && v1.cpos.x <-v1.cpos.w && v2.cpos.x <-v2.cpos.w)
-				return{};
-			if (v0.cpos.y > v0.cpos.w && v1.cpos.y > v1.cpos.w && v2.cpos.y > v2.cpos.w)
-				return{};
-			if (v0.cpos.y <-v0.cpos.w && v1.cpos.y <-v1.cpos.w && v2.cpos.y <-v2.cpos.w)
-				return{};
-			if (v0.cpos.z > v0.cpos.w && v1.cpos.z > v1.cpos.w && v2.cpos.z > v2.cpos.w)
-				return{};
-			if (v0.cpos.z <-v0.cpos.w && v1.cpos.z <-v1.cpos.w && v2.cpos.z <-v2.cpos.w)
-				return{};
+			if (clipDistance(cpos, plane) < 0.0f)
+				outcode |= (1u << plane);
 		}
+		if (cpos.w < m_frustum_near_far.x)
+			outcode |= CULL_NEAR;
+		if (cpos.w > m_frustum_near_far.y)
+			outcode |= CULL_FAR;
+		return outcode;
+	}
 
-		std::vector<TRShadingPipeline::VertexData> inside_vertices;
-		std::vector<TRShadingPipeline::VertexData> tmp = { v0, v1, v2 };
-		enum Axis { X = 0, Y = 1, Z = 2};
+	TRRenderer::BoundsVisibility TRRenderer::classifyBounds(const TRDrawableMesh &mesh) const
+	{
+		const glm::mat4 &model = mesh.getModelMatrix();
+		const glm::mat4 view_project = m_projectMatrix * m_viewMatrix;
 
-		//w=x plane & w=-x plane
+		//Bounding sphere first, cheap rejection before transforming the box
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, -1);
-			tmp = inside_vertices;
+			glm::vec4 planes[6];
+			computeFrustumPlanes(view_project * model, planes);
+			if (isSphereOutside(planes, mesh.getBoundingSphere()))
+				return BOUNDS_OUTSIDE;
 		}
 
-		//w=y plane & w=-y plane
+		//Bounding box corners, transformed the same way as the vertices
+		//Note: the planes are linear in the object space, so the box is outside a plane if all of its
+		//      corners are, and inside all the planes if all of its corners are.
+		const glm::vec3 &box_min = mesh.getBoundingBoxMin();
+		const glm::vec3 &box_max = mesh.getBoundingBoxMax();
+		unsigned int outcode_and = ~0u, outcode_or = 0u;
+		for (int corner = 0; corner < 8; ++corner)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, +1);
-			tmp = inside_vertices;
+			const glm::vec4 pos((corner & 1) ? box_max.x : box_min.x,
+				(corner & 2) ? box_max.y : box_min.y, (corner & 4) ? box_max.z : box_min.z, 1.0f);
+			const unsigned int outcode = computeOutcode(view_project * (model * pos));
+			outcode_and &= outcode;
+			outcode_or |= outcode;
+		}
+		if (outcode_and != 0)
+			return BOUNDS_OUTSIDE;
+		return outcode_or == 0 ? BOUNDS_INSIDE : BOUNDS_CROSSING;
+	}
 
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, -1);
-			tmp = inside_vertices;
+	void TRRenderer::computeFrustumPlanes(const glm::mat4 &mvp, glm::vec4 planes[6])
+	{
+		//Gribb-Hartmann: a clip space plane p is the plane p * mvp in the object space
+		static const glm::vec4 clip_planes[6] = {
+			glm::vec4(-1, 0, 0, 1), glm::vec4(1, 0, 0, 1),
+			glm::vec4(0, -1, 0, 1), glm::vec4(0, 1, 0, 1),
+			glm::vec4(0, 0, -1, 1), glm::vec4(0, 0, 1, 1) };
+		for (int i = 0; i < 6; ++i)
+		{
+			const glm::vec4 plane = clip_planes[i] * mvp;
+			const float length = glm::length(glm::vec3(plane));
+			//Note: a degenerate plane culls nothing
+			planes[i] = (length > 0.0f) ? plane / length : glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
 		}
+	}
 
-		//w=z plane & w=-z plane
+	bool TRRenderer::isSphereOutside(const glm::vec4 planes[6], const glm::vec4 &sphere)
+	{
+		const glm::vec4 center(glm::vec3(sphere), 1.0f);
+		for (int i = 0; i < 6; ++i)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, +1);
-			tmp = inside_vertices;
+			if (glm::dot(planes[i], center) < -sphere.w)
+				return true;
+		}
+		return false;
+	}
+
+	void TRRenderer::cullClusters(const TRDrawableMesh &mesh, bool inside, TRCullFaceMode cullfaceMode)
+	{
+		const glm::mat4 mvp = m_projectMatrix * m_viewMatrix * mesh.getModelMatrix();
+		glm::vec4 planes[6];
+		computeFrustumPlanes(mvp, planes);
 
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, -1);
-			tmp = inside_vertices;
+		//The eye in the object space as a homogeneous point (at infinity for orthographic projections),
+		//i.e. the null vector of the x, y and w rows of the matrix, which lands on the screen nowhere.
+		//The screen winding of a face in front of the eye is then the sign of dot(n, eye.xyz - eye.w * p)
+		//for its normal n and any point p on it, whatever the model, view and projection matrices are.
+		glm::vec4 eye;
+		{
+			const glm::vec4 rx = glm::vec4(mvp[0][0], mvp[1][0], mvp[2][0], mvp[3][0]);
+			const glm::vec4 ry = glm::vec4(mvp[0][1], mvp[1][1], mvp[2][1], mvp[3][1]);
+			const glm::vec4 rw = glm::vec4(mvp[0][3], mvp[1][3], mvp[2][3], mvp[3][3]);
+			auto minor = [&](int i, int j, int k) -> float
+			{
+				return glm::determinant(glm::mat3(
+					glm::vec3(rx[i], ry[i], rw[i]), glm::vec3(rx[j], ry[j], rw[j]), glm::vec3(rx[k], ry[k], rw[k])));
+			};
+			eye = glm::vec4(minor(1, 2, 3), -minor(0, 2, 3), minor(0, 1, 3), -minor(0, 1, 2));
 		}
+		//Facing away means the culled winding of isBackFacing
+		const float facing = (cullfaceMode == TRCullFaceMode::TR_CULL_BACK) ? 1.0f : -1.0f;
 
-		//w=1e-5 plane
+		const auto &clusters = mesh.getMeshClusters();
+		const auto &clusterFaces = mesh.getClusterFaces();
+		const auto &faces = mesh.getMeshFaces();
+		m_face_marks.assign(faces.size(), 0);
+		m_vertex_marks.assign(mesh.getMeshVertices().size(), 0);
+		m_visible_vertices.clear();
+		for (unsigned int c = 0; c < clusters.size(); ++c)
 		{
-			inside_vertices = {};
-			int num_verts = tmp.size();
-			constexpr float w_clipping_plane = 1e-5;
-			for (int i = 0; i < num_verts; ++i)
+			const TRMeshCluster &cluster = clusters[c];
+			const glm::vec4 &sphere = cluster.boundingSphere;
+			if (!inside && isSphereOutside(planes, sphere))
 			{
-				const auto &beg_vert = tmp[(i - 1 + num_verts) % num_verts];
-				const auto &end_vert = tmp[i];
-				float beg_is_inside = (beg_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				float end_is_inside = (end_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				//One of them is outside
-				if (beg_is_inside * end_is_inside < 0)
+				m_clip_cull_profile.m_num_cliped_triangles += cluster.numFaces;
+				TR_STAT(m_statistics.clusterCulledFaces += cluster.numFaces);
+				continue;
+			}
+
+			//All the faces look away if every normal of the cone makes more than 90 degrees
+			//with the direction towards the eye from every point of the sphere
+			if (cullfaceMode != TRCullFaceMode::TR_CULL_DISABLE)
+			{
+				const glm::vec3 toward = facing * (glm::vec3(eye) - eye.w * glm::vec3(sphere));
+				if (-glm::dot(cluster.coneAxis, toward) > cluster.coneCutoff * glm::length(toward)
+					+ (1.0f + cluster.coneCutoff) * std::abs(eye.w) * sphere.w)
 				{
-					// t = (w_clipping_plane-w1)/((w1-w2)
-					float t = (w_clipping_plane - beg_vert.cpos.w) / (beg_vert.cpos.w - end_vert.cpos.w);
-					auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-					inside_vertices.push_back(intersected_vert);
+					m_clip_cull_profile.m_num_culled_triangles += cluster.numFaces;
+					TR_STAT(m_statistics.clusterCulledFaces += cluster.numFaces);
+					continue;
 				}
-				//If current vertices is inside
-				if (end_is_inside > 0)
+			}
+
+			for (unsigned int i = cluster.firstFace; i < cluster.firstFace + cluster.numFaces; ++i)
+			{
+				const unsigned int f = clusterFaces[i];
+				m_face_marks[f] = 1;
+				for (int v = 0; v < 3; ++v)
 				{
-					inside_vertices.push_back(end_vert);
+					const unsigned int index = faces[f].vertIndex[v];
+					if (!m_vertex_marks[index])
+					{
+						m_vertex_marks[index] = 1;
+						m_visible_vertices.push_back(index);
+					}
 				}
 			}
 		}
-		
-		return inside_vertices;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman_aux(
-		const std::vector<TRShadingPipeline::VertexData> &polygon,
-		const int &axis,
-		const int &side) const
+	float TRRenderer::clipDistance(const glm::vec4 &cpos, int plane) const
+	{
+		//Signed distance to the plane, positive inside
+		constexpr float w_clipping_plane = 1e-5f;
+		switch (1u << plane)
+		{
+			case CLIP_POS_X: return cpos.w - cpos.x;
+			case CLIP_NEG_X: return cpos.w + cpos.x;
+			case CLIP_POS_Y: return cpos.w - cpos.y;
+			case CLIP_NEG_Y: return cpos.w + cpos.y;
+			case CLIP_POS_Z: return cpos.w - cpos.z;
+			case CLIP_NEG_Z: return cpos.w + cpos.z;
+			case CLIP_W: return cpos.w - w_clipping_plane;
+			case GUARD_POS_X: return m_guard_band.x * cpos.w - cpos.x;
+			case GUARD_NEG_X: return m_guard_band.x * cpos.w + cpos.x;
+			case GUARD_POS_Y: return m_guard_band.y * cpos.w - cpos.y;
+			case GUARD_NEG_Y: return m_guard_band.y * cpos.w + cpos.y;
+			default: return 0.0f;
+		}
+	}
+
+	bool TRRenderer::clipPolygon(ClipPolygon &polygon, unsigned int planes) const
 	{
-		std::vector<TRShadingPipeline::VertexData> inside_polygon;
+		//Clipping in the homogeneous clipping space
+		//Refs:
+		//https://fabiensanglard.net/polygon_codec/clippingdocument/Clipping.pdf
+		//https://fabiensanglard.net/polygon_codec/
 
-		int num_verts = polygon.size();
-		for (int i = 0; i < num_verts; ++i)
+		//Note: ping-pong between the polygon and a scratch buffer, no heap allocation at all
+		ClipPolygon scratch;
+		ClipPolygon *src = &polygon, *dst = &scratch;
+		for (int plane = 0; plane < NUM_CLIP_PLANES; ++plane)
 		{
-			const auto &beg_vert = polygon[(i - 1 + num_verts) % num_verts];
-			const auto &end_vert = polygon[i];
-			char beg_is_inside = ((side * (beg_vert.cpos[axis]) <= beg_vert.cpos.w) ? 1 : -1);
-			char end_is_inside = ((side * (end_vert.cpos[axis]) <= end_vert.cpos.w) ? 1 : -1);
-			//One of them is outside
-			if (beg_is_inside * end_is_inside < 0)
-			{
-				// t = (w1 - y1)/((w1-y1)-(w2-y2))
-				float t = (beg_vert.cpos.w - side * beg_vert.cpos[axis])
-					/ ((beg_vert.cpos.w - side * beg_vert.cpos[axis]) - (end_vert.cpos.w - side * end_vert.cpos[axis]));
-				auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-				inside_polygon.push_back(intersected_vert);
-			}
-			//If current vertices is inside
-			if (end_is_inside > 0)
+			if ((planes & (1u << plane)) == 0)
+				continue;
+
+			dst->size = 0;
+			const int num_verts = src->size;
+			for (int i = 0; i < num_verts; ++i)
 			{
-				inside_polygon.push_back(end_vert);
+				const auto &beg_vert = src->vertices[(i - 1 + num_verts) % num_verts];
+				const auto &end_vert = src->vertices[i];
+				float beg_dist = clipDistance(beg_vert.cpos, plane);
+				float end_dist = clipDistance(end_vert.cpos, plane);
+				//One of them is outside
+				if ((beg_dist >= 0.0f) != (end_dist >= 0.0f))
+				{
+					float t = beg_dist / (beg_dist - end_dist);
+					dst->vertices[dst->size++] = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
+				}
+				//If current vertices is inside
+				if (end_dist >= 0.0f)
+				{
+					dst->vertices[dst->size++] = end_vert;
+				}
 			}
+
+			std::swap(src, dst);
+			if (src->size < 3)
+				return false;
+		}
+
+		if (src != &polygon)
+		{
+			polygon.size = src->size;
+			std::copy(src->vertices, src->vertices + src->size, polygon.vertices);
 		}
-		return inside_polygon;
+		return true;
 	}
 
 	bool TRRenderer::isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const
@@ -2,11 +2,12 @@
 #define TRRENDERER_H
 
 #include "glm/glm.hpp"
-#include "SDL2/SDL.h"
 #include "TRFrameBuffer.h"
 #include "TRDrawableMesh.h"
 #include "TRShadingState.h"
 #include "TRShadingPipeline.h"
+#include "TRThreadPool.h"
+#include "TRStatistics.h"
 
 #include <mutex>
 
@@ -17,7 +18,9 @@ namespace TinyRenderer
 	public:
 		typedef std::shared_ptr<TRRenderer> ptr;
 
-		TRRenderer(int width, int height);
+		//Note: the renderer draws with the textures, lights and viewer of the context, the default
+		//      context if none is given, so the meshes must be loaded into the same context.
+		TRRenderer(int width, int height, TRRenderContext::ptr context = nullptr);
 		~TRRenderer() = default;
 
 		//Drawable objects load/unload
@@ -33,6 +36,31 @@ namespace TinyRenderer
 		void setProjectMatrix(const glm::mat4 &project, float near, float far);
 		void setShaderPipeline(TRShadingPipeline::ptr shader);
 		void setViewerPos(const glm::vec3 &viewer);
+		const TRRenderContext::ptr &getRenderContext() const { return m_context; }
+
+		//Anti-aliasing: with TR_MSAA_4X the coverage and depth are sampled 4 times per pixel, but the
+		//pixels are still shaded once per triangle, and the samples are averaged at the end of the frame
+		//Note: the filled triangles are snapped to subpixels then, which only fits the integer edge
+		//      functions for frame buffers up to m_msaa_guard_band_pixels, false is returned otherwise.
+		bool setMultisampleMode(TRMultisampleMode mode);
+		TRMultisampleMode getMultisampleMode() const;
+
+		//Depth prepass: every tile rasterizes the depth of its opaque filled triangles first, then
+		//shades only the fragments matching the nearest depth, i.e. once per pixel whatever the draw order
+		void setDepthPrepassMode(TRDepthPrepassMode mode) { m_depth_prepass = mode; }
+		TRDepthPrepassMode getDepthPrepassMode() const { return m_depth_prepass; }
+
+		//Deferred shading: the tiles rasterize the surfaces into the G-buffer of the frame buffer, then
+		//a lighting pass shades its pixels. The G-buffer is kept across frames, and a tile is rasterized
+		//again only if the triangles binned to it changed, so frames where only the lights and the viewer
+		//move cost just the geometry stage and the lighting pass.
+		//Note: the textures are assumed unchanged, and multisampling falls back to the forward shading.
+		void setDeferredShadingMode(TRDeferredShadingMode mode) { m_deferred_shading = mode; }
+		TRDeferredShadingMode getDeferredShadingMode() const { return m_deferred_shading; }
+
+		//Number of rendering threads (including the calling thread), 0 means hardware concurrency
+		void setNumberOfThreads(int num);
+		int getNumberOfThreads() const;
 
 		int addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color);
 		//--------------
@@ -54,35 +82,123 @@ namespace TinyRenderer
 		unsigned int getNumberOfClipFaces() const;
 		unsigned int getNumberOfCullFaces() const;
 
+		//Wall-clock time of the stages of the last frame in milliseconds
+		//Note: rasterization, depth testing and fragment shading are fused in the tile pass
+		struct FrameTimings
+		{
+			double vertexStage = 0.0;    //Vertex shading
+			double clipStage = 0.0;      //Primitive assembly, clipping, culling and tile binning
+			double rasterStage = 0.0;    //Tile pass: rasterization, depth testing and fragment shading
+		};
+		const FrameTimings &getFrameTimings() const { return m_frame_timings; }
+
+		//Pipeline statistics of the last frame, all zeros unless built with TR_ENABLE_STATISTICS
+		const TRPipelineStatistics &getPipelineStatistics() const { return m_statistics; }
+		//Write the number of shaded fragments per pixel of the last frame as a color coded PPM image
+		//Note: return false if the statistics are disabled or the file can't be written
+		bool dumpOverdrawHeatmap(const std::string &filename) const;
+
 
 
 	private:
 
-		//Homogeneous space clipping - Sutherland Hodgeman algorithm
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman(
-			const TRShadingPipeline::VertexData &v0,
-			const TRShadingPipeline::VertexData &v1,
-			const TRShadingPipeline::VertexData &v2) const;
-
-		//Cliping auxiliary functions
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman_aux(
-			const std::vector<TRShadingPipeline::VertexData> &polygon,
-			const int &axis, 
-			const int &side) const;
-		bool isPointInsideInClipingFrustum(const glm::vec4 &p) const
+		//Screen space triangle waiting for the tile rasterization
+		struct RasterTriangle
+		{
+			TRShadingPipeline::VertexData v[3];
+			const TRMaterial *material;      //Material of the batch
+			TRPolygonMode polygonMode;
+			TRDepthTestMode depthtestMode;
+			TRDepthWriteMode depthwriteMode;
+			bool lightingEnable;
+		};
+
+		//Tile-based rasterization
+		void cullLights();
+		bool binTriangle(const RasterTriangle &tri);
+		//Screen position units per pixel of the triangles rasterized in the given mode
+		int getSubpixelUnits(TRPolygonMode mode) const;
+		void rasterizeTile(int tile, int slot);
+		void rasterizeDepth(const unsigned int *first, const unsigned int *last, const glm::ivec4 &region);
+		//Hash of everything the rasterization of a tile into the G-buffer depends on
+		unsigned long long computeTileKey(const std::vector<unsigned int> &bin) const;
+		//The triangles whose depth is laid by the prepass (filled, depth tested and written)
+		bool isPrepassed(const RasterTriangle &tri) const
 		{
-			return (p.x <= p.w && p.x >= -p.w)
-				&& (p.y <= p.w && p.y >= -p.w)
-				&& (p.z <= p.w && p.z >= -p.w)
-				&& (p.w <= m_frustum_near_far.y && p.w >= m_frustum_near_far.x);
+			return m_depth_prepass == TRDepthPrepassMode::TR_DEPTH_PREPASS_ENABLE
+				&& tri.polygonMode == TRPolygonMode::TR_TRIANGLE_FILL
+				&& tri.depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE
+				&& tri.depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE;
 		}
 
+		//Inner loops specialized for the type of the shading pipeline and the features of a batch,
+		//so the shaders are inlined instead of called through the virtual functions
+		typedef void (TRRenderer::*VertexKernel)(const unsigned int *first, const unsigned int *last, int slot, 
+			const TRVertexAttrib &vertices, const std::vector<TRMeshVertex> &meshVertices, bool outcodes);
+		typedef void (TRRenderer::*BatchKernel)(const unsigned int *first, const unsigned int *last, 
+			const glm::ivec4 &region, int slot);
+		typedef void (TRRenderer::*LightKernel)(const glm::ivec4 &region, int slot);
+		template<typename Shader>
+		void shadeVertices(const unsigned int *first, const unsigned int *last, int slot, 
+			const TRVertexAttrib &vertices, const std::vector<TRMeshVertex> &meshVertices, bool outcodes);
+		template<typename Shader, unsigned int Features>
+		void rasterizeBatch(const unsigned int *first, const unsigned int *last, const glm::ivec4 &region, int slot);
+		template<typename Shader>
+		void lightTile(const glm::ivec4 &region, int slot);
+		template<typename Shader, unsigned int... Features>
+		void selectKernels(TRFeatureList<Features...>);
+		void selectKernels();
+
+		//Homogeneous space clipping planes, one bit per plane in the outcodes
+		enum ClipPlaneBit
+		{
+			CLIP_POS_X = 1 << 0,    //x <= w
+			CLIP_NEG_X = 1 << 1,    //x >= -w
+			CLIP_POS_Y = 1 << 2,    //y <= w
+			CLIP_NEG_Y = 1 << 3,    //y >= -w
+			CLIP_POS_Z = 1 << 4,    //z <= w
+			CLIP_NEG_Z = 1 << 5,    //z >= -w
+			CLIP_W = 1 << 6,        //w >= 1e-5
+			GUARD_POS_X = 1 << 7,   //x <= guard_band.x * w
+			GUARD_NEG_X = 1 << 8,   //x >= -guard_band.x * w
+			GUARD_POS_Y = 1 << 9,   //y <= guard_band.y * w
+			GUARD_NEG_Y = 1 << 10,  //y >= -guard_band.y * w
+			NUM_CLIP_PLANES = 11,
+			CULL_NEAR = 1 << 11,    //w >= near, only for trivial rejection
+			CULL_FAR = 1 << 12      //w <= far, only for trivial rejection
+		};
+
+		//Fixed capacity polygon for clipping, lives on the stack
+		//Note: at most 7 planes are clipped against (near/far, w and 4 guard band planes for filling,
+		//      or the 6 frustum planes and w for wireframe), and every plane adds at most one vertex.
+		struct ClipPolygon
+		{
+			enum { MAX_VERTICES = 3 + 7 };
+			TRShadingPipeline::VertexData vertices[MAX_VERTICES];
+			int size = 0;
+		};
+
+		//Homogeneous space clipping - Sutherland Hodgeman algorithm
+		unsigned int computeOutcode(const glm::vec4 &cpos) const;
+		float clipDistance(const glm::vec4 &cpos, int plane) const;
+		//Clip the polygon in place against the given planes, return false if nothing is left
+		bool clipPolygon(ClipPolygon &polygon, unsigned int planes) const;
+
+		//Frustum culling of a whole mesh by its object space bounding volumes
+		enum BoundsVisibility { BOUNDS_OUTSIDE, BOUNDS_CROSSING, BOUNDS_INSIDE };
+		BoundsVisibility classifyBounds(const TRDrawableMesh &mesh) const;
+		//Normalized frustum planes pulled back to the object space of the model-view-projection matrix
+		static void computeFrustumPlanes(const glm::mat4 &mvp, glm::vec4 planes[6]);
+		static bool isSphereOutside(const glm::vec4 planes[6], const glm::vec4 &sphere);
+
+		//Cull the clusters of a mesh by the frustum and their normal cones,
+		//mark the faces of the visible clusters and gather the vertices referenced by them
+		void cullClusters(const TRDrawableMesh &mesh, bool inside, TRCullFaceMode cullfaceMode);
+
 		//Back face culling
 		bool isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const;
 
 	private:
-		//-----------------------------------------------------
-		std::vector<TRSpotLight> spotLights;  // 洢۹Ƶ
 		//Drawable mesh array
 		std::vector<TRDrawableMesh::ptr> m_drawableMeshes;
 
@@ -99,19 +215,70 @@ namespace TinyRenderer
 		//Viewport transformation (ndc space -> screen space)
 		glm::mat4 m_viewportMatrix = glm::mat4(1.0f);
 
+		//Guard band in ndc space: filled triangles are rasterized unclipped inside it, 
+		//which keeps the screen coordinates within the range of the integer edge functions
+		//Note: the varyings are interpolated from the original vertices rather than from the ones
+		//      clipped by the x/y planes, so triangles crossing the screen edges (e.g. the floor)
+		//      round their texture coordinates a bit differently than with full frustum clipping.
+		//Note: the subpixel coordinates of multisampling need a guard band 8 times smaller.
+		enum { m_guard_band_pixels = 8191, m_msaa_guard_band_pixels = 2047 };
+		glm::vec2 m_guard_band;
+		void setGuardBand(int pixels);
+
 		//Shader pipeline handler
 		TRShadingPipeline::ptr m_shader_handler = nullptr;
+		TRRenderContext::ptr m_context;
 
 		//Double buffers
 		TRFrameBuffer::ptr m_backBuffer;                      // The frame buffer that's going to be written.
 		TRFrameBuffer::ptr m_frontBuffer;                     // The frame buffer that's going to be displayed.
 
+		//Tiled backend: triangles are binned into screen tiles, and every tile 
+		//is rasterized and shaded by one thread, so threads never share pixels.
+		enum { m_tile_size = 64 };
+		TRDepthPrepassMode m_depth_prepass = TRDepthPrepassMode::TR_DEPTH_PREPASS_DISABLE;
+
+		//Deferred shading, m_deferred_frame tells if the current frame is drawn deferred
+		//Note: the key of a tile describes the G-buffer content of the tile, 0 means invalid.
+		TRDeferredShadingMode m_deferred_shading = TRDeferredShadingMode::TR_DEFERRED_SHADING_DISABLE;
+		bool m_deferred_frame = false;
+		std::vector<unsigned long long> m_tile_surface_keys;
+		int m_num_tiles_x, m_num_tiles_y;
+		std::vector<RasterTriangle> m_raster_triangles;
+		std::vector<std::vector<unsigned int>> m_tile_bins;
+		std::vector<std::vector<unsigned int>> m_tile_lights;  //Lights reaching the tile, see TRRenderContext::LightConstants
+
+		//Post-transform vertex cache of the mesh being drawn
+		enum { m_vertex_chunk_size = 1024 };
+		std::vector<TRShadingPipeline::VertexData> m_shaded_vertices;
+		std::vector<unsigned int> m_shaded_outcodes;
+
+		//Faces of the clusters surviving the culling, only their vertices are shaded
+		std::vector<unsigned char> m_face_marks;
+		std::vector<unsigned char> m_vertex_marks;
+		std::vector<unsigned int> m_visible_vertices;
+
+		//Per thread resources
+		TRThreadPool::ptr m_thread_pool;
+		std::vector<TRShadingPipeline::ptr> m_worker_shaders;
+
+		//Kernels of the current shading pipeline, the batch kernels are indexed by the features
+		VertexKernel m_vertex_kernel = nullptr;
+		const BatchKernel *m_batch_kernels = nullptr;
+		LightKernel m_light_kernel = nullptr;
+
 		struct Profile
 		{
 			unsigned int m_num_cliped_triangles = 0;
 			unsigned int m_num_culled_triangles = 0;
 		};
 		Profile m_clip_cull_profile;
+		FrameTimings m_frame_timings;
+
+		//Pipeline statistics, the tile pass counts into per thread copies
+		TRPipelineStatistics m_statistics;
+		std::vector<TRPipelineStatistics> m_worker_statistics;
+		std::vector<unsigned int> m_overdraw;//Shaded fragments per pixel
 	};
 }
 
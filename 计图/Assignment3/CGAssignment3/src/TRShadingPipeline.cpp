@@ -1,5 +1,8 @@
 #include "TRShadingPipeline.h"
+#include "TRStatistics.h"
 
+#include <cmath>
+#include <limits>
 #include <algorithm>
 #include <iostream>
 
@@ -62,232 +65,58 @@ namespace TinyRenderer
 		v.col = v.col * one_div_w;
 	}
 
-	void TRShadingPipeline::VertexData::aftPrespCorrection(VertexData &v)
+	void TRShadingPipeline::VertexData::aftPrespCorrection(VertexData &v, unsigned int varyings)
 	{
 		//Perspective correction: the world space properties should be multipy by w after rasterization
 		//https://zhuanlan.zhihu.com/p/144331875
 		//We use pos.w to store 1/w
 		float w = 1.0f / v.pos.w;
 		//v.cpos.z *= w;
-		v.pos = glm::vec4(v.pos.x * w, v.pos.y * w, v.pos.z * w, v.pos.w);
-		v.tex = v.tex * w;
-		v.nor = v.nor * w;
-		v.col = v.col * w;
+		if (varyings & TR_VARYING_POS) v.pos = glm::vec4(v.pos.x * w, v.pos.y * w, v.pos.z * w, v.pos.w);
+		if (varyings & TR_VARYING_TEX) v.tex = v.tex * w;
+		if (varyings & TR_VARYING_NOR) v.nor = v.nor * w;
+		if (varyings & TR_VARYING_COL) v.col = v.col * w;
 	}
 
 	//----------------------------------------------TRShadingPipeline----------------------------------------------
 
-	std::vector<TRTexture2D::ptr> TRShadingPipeline::m_global_texture_units = {};
-	std::vector<TRPointLight> TRShadingPipeline::m_point_lights = {};
-	glm::vec3 TRShadingPipeline::m_viewer_pos = glm::vec3(0.0f);
+	//Texture samples of the current thread
+	static thread_local unsigned long long t_texture_samples = 0;
 
 
-	void TRShadingPipeline::rasterize_wire(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
-	{
-		//Draw each line step by step
-		rasterize_wire_aux(v0, v1, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v1, v2, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v0, v2, screen_width, screene_height, rasterized_points);
-	}
-
-	void TRShadingPipeline::rasterize_fill_edge_function(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
-	{
-		VertexData v[] = { v0, v1, v2 };
-		//Edge-equations rasterization algorithm
-		glm::ivec2 bounding_min;
-		glm::ivec2 bounding_max;
-		bounding_min.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), 0);
-		bounding_min.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), 0);
-		bounding_max.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), (int)screen_width - 1);
-		bounding_max.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), (int)screene_height - 1);
-
-		//Adjust the order
-		{
-			auto e1 = v1.spos - v0.spos;
-			auto e2 = v2.spos - v0.spos;
-			int orient = e1.x * e2.y - e1.y * e2.x;
-			if (orient > 0)
-			{
-				std::swap(v[1], v[2]);
-			}
-		}
-
-		//Accelerated Half-Space Triangle Rasterization
-		//Refs:Mileff P, Nehz K, Dudra J. Accelerated half-space triangle rasterization[J].
-		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236. http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
-
-		const glm::ivec2 &A = v[0].spos;
-		const glm::ivec2 &B = v[1].spos;
-		const glm::ivec2 &C = v[2].spos;
-
-		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
-		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
-		const int K01 = A.x * B.y - A.y * B.x;
-		const int K02 = B.x * C.y - B.y * C.x;
-		const int K03 = C.x * A.y - C.y * A.x;
-
-		int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
-		int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
-		int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
-
-		//Degenerated to a line or a point
-		if (F01 + F02 + F03 == 0)
-			return;
-
-		const float one_div_delta = 1.0f / (F01 + F02 + F03);
-
-		//Top left fill rule
-		int E1_t = (((B.y > A.y) || (A.y == B.y && A.x > B.x)) ? 0 : 0);
-		int E2_t = (((C.y > B.y) || (B.y == C.y && B.x > C.x)) ? 0 : 0);
-		int E3_t = (((A.y > C.y) || (C.y == A.y && C.x > A.x)) ? 0 : 0);
-
-		int Cy1 = F01, Cy2 = F02, Cy3 = F03;
-		for (int y = bounding_min.y; y <= bounding_max.y; ++y)
-		{
-			int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
-			for (int x = bounding_min.x; x <= bounding_max.x; ++x)
-			{
-				int E1 = Cx1 + E1_t, E2 = Cx2 + E2_t, E3 = Cx3 + E3_t;
-				//Counter-clockwise winding order
-				if (E1 <= 0 && E2 <= 0 && E3 <= 0)
-				{
-					glm::vec3 uvw(Cx2 * one_div_delta, Cx3 * one_div_delta, Cx1 * one_div_delta);
-					auto rasterized_point = TRShadingPipeline::VertexData::barycentricLerp(v[0], v[1], v[2], uvw);
-					rasterized_point.spos = glm::ivec2(x, y);
-					rasterized_points.push_back(rasterized_point);
-				}
-				Cx1 += I01; Cx2 += I02; Cx3 += I03;
-			}
-			Cy1 += J01; Cy2 += J02; Cy3 += J03;
-		}
-
-	}
-
-	void TRShadingPipeline::rasterize_wire_aux(
-		const VertexData &from,
-		const VertexData &to,
-		const unsigned int &screen_width,
-		const unsigned int &screen_height,
-		std::vector<VertexData> &rasterized_points)
+	void TRShadingPipeline::setupTBN(const glm::vec3 &tangent, const glm::vec3 &bitangent, VertexData v[3]) const
 	{
-		//Bresenham line rasterization
-
-		int dx = to.spos.x - from.spos.x;
-		int dy = to.spos.y - from.spos.y;
-		int stepX = 1, stepY = 1;
-
-		// judge the sign
-		if (dx < 0)
-		{
-			stepX = -1;
-			dx = -dx;
-		}
-		if (dy < 0)
-		{
-			stepY = -1;
-			dy = -dy;
-		}
-
-		int d2x = 2 * dx, d2y = 2 * dy;
-		int d2y_minus_d2x = d2y - d2x;
-		int sx = from.spos.x;
-		int sy = from.spos.y;
-
-		// slope < 1.
-		if (dy <= dx)
-		{
-			int flag = d2y - dx;
-			for (int i = 0; i <= dx; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dx);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x <= screen_width && mid.spos.y >= 0 && mid.spos.y <= screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sx += stepX;
-				if (flag <= 0)
-				{
-					flag += d2y;
-				}
-				else
-				{
-					sy += stepY;
-					flag += d2y_minus_d2x;
-				}
-			}
-		}
-		// slope > 1.
-		else
-		{
-			int flag = d2x - dy;
-			for (int i = 0; i <= dy; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dy);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x < screen_width && mid.spos.y >= 0 && mid.spos.y < screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sy += stepY;
-				if (flag <= 0)
-				{
-					flag += d2x;
-				}
-				else
-				{
-					sx += stepX;
-					flag -= d2y_minus_d2x;
-				}
-			}
-		}
+		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * tangent);
+		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * bitangent);
+		v[0].TBN = glm::mat3(T, B, v[0].nor);
+		v[1].TBN = glm::mat3(T, B, v[1].nor);
+		v[2].TBN = glm::mat3(T, B, v[2].nor);
 	}
 
-	int TRShadingPipeline::upload_texture_2D(TRTexture2D::ptr tex)
+	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv) const
 	{
-		if (tex != nullptr)
-		{
-			m_global_texture_units.push_back(tex);
-			return m_global_texture_units.size() - 1;
-		}
-		return -1;
+		TR_STAT(++t_texture_samples);
+		const TRTexture2D *texture = m_context->getTextureCache().get(id);
+		if (texture == nullptr)
+			return glm::vec4(0.0f);
+		return texture->sample(uv);
 	}
 
-	TRTexture2D::ptr TRShadingPipeline::getTexture2D(int index)
-	{
-		if (index < 0 || index >= m_global_texture_units.size())
-			return nullptr;
-		return m_global_texture_units[index];
-	}
-	
-	int TRShadingPipeline::addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color)
+	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv,
+		const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
 	{
-		m_point_lights.push_back(TRPointLight(pos, atten, color));
-		return m_point_lights.size() - 1;
+		TR_STAT(++t_texture_samples);
+		const TRTexture2D *texture = m_context->getTextureCache().get(id);
+		if (texture == nullptr)
+			return glm::vec4(0.0f);
+		return texture->sample(uv, dUVdx, dUVdy);
 	}
 
-	TRPointLight &TRShadingPipeline::getPointLight(int index)
+	unsigned long long TRShadingPipeline::fetchTextureSampleCount()
 	{
-		return m_point_lights[index];
-	}
-	
-	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv)
-	{
-		if (id < 0 || id >= m_global_texture_units.size())
-			return glm::vec4(0.0f);
-		return m_global_texture_units[id]->sample(uv);
+		unsigned long long count = t_texture_samples;
+		t_texture_samples = 0;
+		return count;
 	}
 
 
@@ -295,33 +124,19 @@ namespace TinyRenderer
 
 	void TRDefaultShadingPipeline::vertexShader(VertexData &vertex)
 	{
-		//Local space -> World space -> Camera space -> Project space
-		vertex.pos = m_model_matrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f);
-		vertex.nor = glm::normalize(m_inv_trans_model_matrix * vertex.nor);
-		vertex.cpos = m_view_project_matrix * vertex.pos;
-
-		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * m_tangent);
-		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * m_bitangent);
-		vertex.TBN = glm::mat3(T, B, vertex.nor);
+		shadeVertex(vertex);
 	}
 
 	void TRDefaultShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
 	{
-		//Just return the color.
-		fragColor = glm::vec4(data.tex, 0.0, 1.0f);
+		shadeFragment<0>(data, fragColor);
 	}
 
 	//----------------------------------------------TRTextureShadingPipeline----------------------------------------------
 
 	void TRTextureShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
 	{
-		//Default color
-		fragColor = glm::vec4(m_ke, 1.0f);
-
-		if (m_diffuse_tex_id != -1)
-		{
-			fragColor = texture2D(m_diffuse_tex_id, data.tex);
-		}
+		dispatch_fragment(*this, getFeatures(), data, fragColor, TRAllFeatures());
 	}
 
 	//----------------------------------------------TRPhongShadingPipeline----------------------------------------------
@@ -390,88 +205,9 @@ namespace TinyRenderer
 		}
 		*/
 
-
-		fragColor = glm::vec4(0.0f);
-
-		//Fetch the corresponding color 
-		glm::vec3 amb_color, dif_color, spe_color, glow_color;
-		amb_color = dif_color = (m_diffuse_tex_id != -1) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex)) : m_kd;
-		spe_color = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex)) : m_ks;
-		glow_color = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex)) : m_ke;
-
-		std::vector<glm::vec3> vectors;
-		vectors.push_back(m_point_lights[0].lightPos);
-		vectors.push_back(m_point_lights[1].lightPos);
-		vectors.push_back(m_point_lights[2].lightPos);
-		glm::vec3 sum(0.0f, 0.0f, 0.0f);
-		for (const glm::vec3& vector : vectors) {
-			sum += vector;
-		}
-		int numVectors = vectors.size();
-		glm::vec3 average = sum / static_cast<float>(numVectors);
-		//No lighting
-		if (!m_lighting_enable)
-		{
-			fragColor = glm::vec4(glow_color, 1.0f);
-			return;
-		}
-		//Calculate the lighting
-		glm::vec3 fragPos = glm::vec3(data.pos);  // Ƭεռλ
-		glm::vec3 normal = glm::normalize(data.nor);  // Ƭεķ
-		glm::vec3 viewDir = glm::normalize(m_viewer_pos - fragPos);  // ӽǷ
-		for (size_t i = 0; i < m_point_lights.size(); ++i)
-		{
-			const auto& light = m_point_lights[i];
-			glm::vec3 lightDir = glm::normalize(light.lightPos - fragPos);  // ԴƬεķ
-			glm::vec3 ambient, diffuse, specular;
-			float attenuation = 1.0f;
-			{
-				// ۹ƵĹǿ
-				float theta = glm::dot(lightDir, glm::normalize(-(average - light.lightPos)));
-				float cutOff = glm::cos(glm::radians(12.5f));
-				float outerCutOff = glm::cos(glm::radians(17.5f));
-				float epsilon = cutOff - outerCutOff;
-				float intensity = glm::clamp((theta - outerCutOff) / epsilon, 0.0f, 1.0f);
-
-				// ⡢䡢淴ļ
-				ambient = amb_color * light.lightColor;
-				diffuse = dif_color * light.lightColor * glm::max(glm::dot(normal, lightDir), 0.0f);
-				glm::vec3 halfwayDir = glm::normalize(viewDir + lightDir);
-				specular = spe_color * light.lightColor * glm::pow(glm::max(glm::dot(normal, halfwayDir), 0.0f), m_shininess);
-
-				// ǿӦõ;淴
-				diffuse *= intensity;
-				specular *= intensity;
-
-				// Դ˥
-				float distance = glm::length(light.lightPos - fragPos);
-				attenuation = 1.0f / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
-			}
-			// ۼÿԴĹս
-			fragColor.x += (ambient.x + diffuse.x + specular.x) * attenuation;
-			fragColor.y += (ambient.y + diffuse.y + specular.y) * attenuation;
-			fragColor.z += (ambient.z + diffuse.z + specular.z) * attenuation;
-		}
-
-		
-		// ӷ⣨glowЧ
-		fragColor = glm::vec4(fragColor.x + glow_color.x, fragColor.y + glow_color.y, fragColor.z + glow_color.z, 1.0f);
-		// ɫӳ䣺Ӹ߶̬ΧHDRתΪͶ̬ΧLDR
-		//Tone mapping: HDR -> LDR
-		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
-		{
-			glm::vec3 hdrColor(fragColor);
-			fragColor.x = 1.0f - glm::exp(-hdrColor.x * 2.0f);
-			fragColor.y = 1.0f - glm::exp(-hdrColor.y * 2.0f);
-			fragColor.z = 1.0f - glm::exp(-hdrColor.z * 2.0f);
-		}
-		
-
-
-
-		}
-
-		
+		//Note: the renderer calls the specialized shadeFragment directly
+		dispatch_fragment(*this, getFeatures(), data, fragColor, TRAllFeatures());
+	}
 
 	void TRPhongShadingPipeline::fetchFragmentColor(glm::vec3 &amb, glm::vec3 &diff, glm::vec3 &spe, const glm::vec2 &uv) const
 	{
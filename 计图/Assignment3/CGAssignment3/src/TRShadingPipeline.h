@@ -3,10 +3,14 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include "glm/glm.hpp"
 
 #include "TRTexture2D.h"
+#include "TRRenderContext.h"
+#include "TRShadingState.h"
+#include "TRRasterKernel.h"
 namespace TinyRenderer
 {
 	
@@ -28,6 +32,8 @@ namespace TinyRenderer
 			glm::vec4 cpos; //Clip space position
 			glm::ivec2 spos;//Screen space position
 			glm::mat3 TBN;  //Tangent, bitangent, normal matrix
+			glm::vec2 texDx;//Screen space derivatives of tex over the 2x2 pixel quad,
+			glm::vec2 texDy;//only set by the filling rasterizer (zero otherwise)
 			
 			//Linear interpolation
 			static VertexData lerp(const VertexData &v0, const VertexData &v1, float frac);
@@ -35,7 +41,24 @@ namespace TinyRenderer
 
 			//Perspective correction for interpolation
 			static void prePerspCorrection(VertexData &v);
-			static void aftPrespCorrection(VertexData &v);
+			static void aftPrespCorrection(VertexData &v, unsigned int varyings = TR_VARYING_ALL);
+
+			//Plane equation stepping: result = base + grad * t for the given varyings
+			//Note: pos.w (1/w) is always stepped since the perspective correction needs it
+			static void planeStep(const VertexData &base, const VertexData &grad, float t, 
+				unsigned int varyings, VertexData &result)
+			{
+				result.pos.w = base.pos.w + grad.pos.w * t;
+				if (varyings & TR_VARYING_POS)
+				{
+					result.pos.x = base.pos.x + grad.pos.x * t;
+					result.pos.y = base.pos.y + grad.pos.y * t;
+					result.pos.z = base.pos.z + grad.pos.z * t;
+				}
+				if (varyings & TR_VARYING_COL) result.col = base.col + grad.col * t;
+				if (varyings & TR_VARYING_NOR) result.nor = base.nor + grad.nor * t;
+				if (varyings & TR_VARYING_TEX) result.tex = base.tex + grad.tex * t;
+			}
 		};
 
 		virtual ~TRShadingPipeline() = default;
@@ -60,57 +83,125 @@ namespace TinyRenderer
 		void setNormalTexId(const int &id) { m_normal_tex_id = id; }
 		void setGlowTexId(const int &id) { m_glow_tex_id = id; }
 		void setShininess(const float &shininess) { m_shininess = shininess; }
-		void setTangent(const glm::vec3 &tangent) { m_tangent = tangent; }
-		void setBitangent(const glm::vec3 &bitangent) { m_bitangent = bitangent; }
+
+		//Primitive assembly: TBN matrix of a face from its tangent and bitangent in model space,
+		//the normals come from the shaded vertices, so the vertex shader stays independent of faces
+		void setupTBN(const glm::vec3 &tangent, const glm::vec3 &bitangent, VertexData v[3]) const;
 
 		//Shaders
 		virtual void vertexShader(VertexData &vertex) = 0;
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) = 0;
 
+		//Varyings (TRVaryingBit) the fragment shader reads, the others are never interpolated
+		virtual unsigned int getVaryings() const { return TR_VARYING_ALL; }
+
+		//Features (TRShadingFeatureBit) of the current material and lighting setting
+		unsigned int getFeatures() const
+		{
+			return (m_diffuse_tex_id != -1 ? TR_FEATURE_DIFFUSE_MAP : 0)
+				| (m_specular_tex_id != -1 ? TR_FEATURE_SPECULAR_MAP : 0)
+				| (m_glow_tex_id != -1 ? TR_FEATURE_GLOW_MAP : 0)
+				| (m_lighting_enable ? TR_FEATURE_LIGHTING : 0);
+		}
+
+		//Non-virtual shaders for the raster loops specialized by the pipeline type (see TRRenderer)
+		//Note: the built-in pipelines hide these with inlined shaders, where the features are
+		//      compile-time constants. Only the features in m_shading_features are specialized,
+		//      and shadeFragment<Features> must be called with the current getFeatures().
+		enum { m_shading_features = 0 };
+		void shadeVertex(VertexData &vertex) { vertexShader(vertex); }
+		template<unsigned int Features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) { fragmentShader(data, fragColor); }
+
+		//Deferred shading: the pipelines with m_deferred_lighting split shadeFragment in two for the
+		//lit features, shadeSurface fetches the material and lightSurface lights it in the lighting pass.
+		//The other pipelines and features are shaded as usual, and their final color is stored instead.
+		enum { m_deferred_lighting = 0 };
+		template<unsigned int Features>
+		void shadeSurface(const VertexData &/*data*/, TRSurface &/*surface*/) const {}
+		void lightSurface(const TRSurface &surface, glm::vec4 &fragColor) const { fragColor = glm::vec4(surface.emission, surface.alpha); }
+
+		//Copy of the pipeline with the same settings, each rendering thread shades with its own copy
+		virtual TRShadingPipeline::ptr clone() const = 0;
+
 		//Rasterization
+		//Note: only the pixels inside the region [x_min, y_min, x_max, y_max] (inclusive) are generated.
+		//      Each pixel is streamed to depth_test(x, y, depth) first, and only the survivors are 
+		//      interpolated and handed to fragment(VertexData &), so no fragment array is built.
+		//      The fragment gets the perspective corrected varyings, spos and the depth in cpos.z,
+		//      only spos and the depth with no varyings (depth only rasterization).
+		//      With TR_VARYING_TEX the filling rasterizer also differentiates tex over the aligned 
+		//      2x2 quad of the pixel (texDx, texDy), which the mipmapped texture sampling relies on.
+		//      The filling rasterizer walks the triangle in 8x8 blocks and asks 
+		//      occluded(x0, y0, x1, y1, min_depth) before touching the pixels, first for the whole 
+		//      triangle and then for every block, so hidden geometry is rejected in bulk.
+		//      The filling rasterizer evaluates the coverage and the depth of Samples samples per pixel
+		//      (1 or TR_MSAA_SAMPLES at TR_MSAA_OFFSETS), but shades a pixel only once at its center.
+		//      With multisampling the vertices' spos are in 1/TR_SAMPLE_UNITS pixels (the fragment's aren't):
+		//      depth_test(x, y, depth, coverage) gets the depth of every sample and the covered samples
+		//      as a bit mask, and returns the samples passing, then fragment(VertexData &, samples, depth)
+		//      is called if any of them passes. The wireframe rasterizer uses depth_test(x, y, depth)
+		//      and fragment(VertexData &) instead.
+		template<typename DepthFunc, typename FragmentFunc>
 		static void rasterize_wire(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height, 
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec4 &region,
+			unsigned int varyings,
+			DepthFunc &&depth_test,
+			FragmentFunc &&fragment);
+		template<unsigned int Samples, typename OcclusionFunc, typename DepthFunc, typename FragmentFunc>
 		static void rasterize_fill_edge_function(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
-
-		//Textures and lights
-		static int upload_texture_2D(TRTexture2D::ptr tex);
-		static TRTexture2D::ptr getTexture2D(int index);
-		static int addPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color);
-		static TRPointLight &getPointLight(int index);
-		static void setViewerPos(const glm::vec3 &viewer) { m_viewer_pos = viewer; }
-		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv);
+			const glm::ivec4 &region,
+			unsigned int varyings,
+			OcclusionFunc &&occluded,
+			DepthFunc &&depth_test,
+			FragmentFunc &&fragment);
+
+		//Textures, lights and viewer of the shading, the renderer sets its own before drawing
+		void setRenderContext(const TRRenderContext::ptr &context) { m_context = context; }
+		const TRRenderContext::ptr &getRenderContext() const { return m_context; }
+		glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv) const;
+		glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const;
+		//Return and reset the number of texture2D calls of the calling thread (see TR_ENABLE_STATISTICS)
+		static unsigned long long fetchTextureSampleCount();
+
+		//Lights shading the fragments as indices into the light constants, nullptr means all of them
+		void setLightList(const std::vector<unsigned int> *lights) { m_light_list = lights; }
 
 	protected:
 
+		//Call shader.shadeFragment with the features known at runtime, for the virtual fragment shaders
+		template<typename Shader, unsigned int... Features>
+		static void dispatch_fragment(const Shader &shader, unsigned int features, 
+			const VertexData &data, glm::vec4 &fragColor, TRFeatureList<Features...>)
+		{
+			typedef void (Shader::*FragmentFunc)(const VertexData &, glm::vec4 &) const;
+			static const FragmentFunc table[] = { &Shader::template shadeFragment<Features & Shader::m_shading_features>... };
+			(shader.*table[features])(data, fragColor);
+		}
+
 		//Auxiliary function
+		template<typename DepthFunc, typename FragmentFunc>
 		static void rasterize_wire_aux(
 			const VertexData &begin,
 			const VertexData &end,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec4 &region,
+			unsigned int varyings,
+			DepthFunc &&depth_test,
+			FragmentFunc &&fragment);
 
 		glm::mat4 m_model_matrix = glm::mat4(1.0f);
 		glm::mat3 m_inv_trans_model_matrix = glm::mat3(1.0f);
 		glm::mat4 m_view_project_matrix = glm::mat4(1.0f);
 
-		//Global shading setttings
-		static std::vector<TRTexture2D::ptr> m_global_texture_units;
-		//
-		std::vector<TRSpotLight> m_spot_lights;
-		static std::vector<TRPointLight> m_point_lights;
-		static glm::vec3 m_viewer_pos;
+		//Shading setttings
+		TRRenderContext::ptr m_context = TRRenderContext::getDefault();
+		const std::vector<unsigned int> *m_light_list = nullptr;
 
 		//Material setting
 		glm::vec3 m_ka = glm::vec3(0.0f);
@@ -124,9 +215,6 @@ namespace TinyRenderer
 		int m_glow_tex_id = -1;
 
 		bool m_lighting_enable = true;
-
-		glm::vec3 m_tangent;
-		glm::vec3 m_bitangent;
 	};
 
 	class TRDefaultShadingPipeline : public TRShadingPipeline
@@ -137,8 +225,16 @@ namespace TinyRenderer
 
 		virtual ~TRDefaultShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRDefaultShadingPipeline>(*this); }
+
 		virtual void vertexShader(VertexData &vertex) override;
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual unsigned int getVaryings() const override { return TR_VARYING_TEX; }
+
+		enum { m_shading_features = 0 };
+		void shadeVertex(VertexData &vertex) const;
+		template<unsigned int Features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const;
 
 	};
 
@@ -150,7 +246,13 @@ namespace TinyRenderer
 
 		virtual ~TRTextureShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRTextureShadingPipeline>(*this); }
+
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+
+		enum { m_shading_features = TR_FEATURE_DIFFUSE_MAP };
+		template<unsigned int Features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const;
 	};
 
 	class TRPhongShadingPipeline final : public TRDefaultShadingPipeline
@@ -160,12 +262,522 @@ namespace TinyRenderer
 
 		virtual ~TRPhongShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRPhongShadingPipeline>(*this); }
+
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual unsigned int getVaryings() const override { return TR_VARYING_POS | TR_VARYING_NOR | TR_VARYING_TEX; }
+
+		enum { m_shading_features = TR_FEATURE_ALL };
+		template<unsigned int Features>
+		void shadeFragment(const VertexData &data, glm::vec4 &fragColor) const;
+
+		enum { m_deferred_lighting = 1 };
+		template<unsigned int Features>
+		void shadeSurface(const VertexData &data, TRSurface &surface) const;
+		void lightSurface(const TRSurface &surface, glm::vec4 &fragColor) const;
 
 	private:
 		void fetchFragmentColor(glm::vec3 &amb, glm::vec3 &diff, glm::vec3 &spec, const glm::vec2 &uv) const;
 		
 	};
+
+	//----------------------------------------------TRDefaultShadingPipeline----------------------------------------------
+
+	inline void TRDefaultShadingPipeline::shadeVertex(VertexData &vertex) const
+	{
+		//Local space -> World space -> Camera space -> Project space
+		vertex.pos = m_model_matrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f);
+		vertex.nor = glm::normalize(m_inv_trans_model_matrix * vertex.nor);
+		vertex.cpos = m_view_project_matrix * vertex.pos;
+	}
+
+	template<unsigned int Features>
+	void TRDefaultShadingPipeline::shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+	{
+		//Just return the color.
+		fragColor = glm::vec4(data.tex, 0.0, 1.0f);
+	}
+
+	//----------------------------------------------TRTextureShadingPipeline----------------------------------------------
+
+	template<unsigned int Features>
+	void TRTextureShadingPipeline::shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+	{
+		//Default color
+		fragColor = glm::vec4(m_ke, 1.0f);
+
+		if (Features & TR_FEATURE_DIFFUSE_MAP)
+		{
+			fragColor = texture2D(m_diffuse_tex_id, data.tex, data.texDx, data.texDy);
+		}
+	}
+
+	//----------------------------------------------TRPhongShadingPipeline----------------------------------------------
+
+	template<unsigned int Features>
+	void TRPhongShadingPipeline::shadeFragment(const VertexData &data, glm::vec4 &fragColor) const
+	{
+		TRSurface surface;
+		shadeSurface<Features>(data, surface);
+
+		//No lighting
+		if (!(Features & TR_FEATURE_LIGHTING))
+		{
+			fragColor = glm::vec4(surface.emission, 1.0f);
+			return;
+		}
+		lightSurface(surface, fragColor);
+	}
+
+	template<unsigned int Features>
+	void TRPhongShadingPipeline::shadeSurface(const VertexData &data, TRSurface &surface) const
+	{
+		//Fetch the corresponding color 
+		surface.albedo = (Features & TR_FEATURE_DIFFUSE_MAP) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex, data.texDx, data.texDy)) : m_kd;
+		surface.specular = (Features & TR_FEATURE_SPECULAR_MAP) ? glm::vec3(texture2D(m_specular_tex_id, data.tex, data.texDx, data.texDy)) : m_ks;
+		surface.emission = (Features & TR_FEATURE_GLOW_MAP) ? glm::vec3(texture2D(m_glow_tex_id, data.tex, data.texDx, data.texDy)) : m_ke;
+		surface.shininess = m_shininess;
+		surface.alpha = 1.0f;
+		if (Features & TR_FEATURE_LIGHTING)
+		{
+			surface.position = glm::vec3(data.pos);  // Ƭεռλ
+			surface.normal = glm::normalize(data.nor);  // Ƭεķ
+		}
+	}
+
+	inline void TRPhongShadingPipeline::lightSurface(const TRSurface &surface, glm::vec4 &fragColor) const
+	{
+		fragColor = glm::vec4(0.0f);
+
+		//Calculate the lighting
+		const glm::vec3 &amb_color = surface.albedo, &dif_color = surface.albedo, &spe_color = surface.specular;
+		const glm::vec3 &fragPos = surface.position;
+		const glm::vec3 &normal = surface.normal;
+		glm::vec3 viewDir = glm::normalize(m_context->getViewerPos() - fragPos);  // ӽǷ
+		//Only the lights of the tile, with the constants computed once per frame
+		const auto &light_constants = m_context->getLightConstants();
+		const unsigned int num_lights = static_cast<unsigned int>(
+			m_light_list != nullptr ? m_light_list->size() : light_constants.size());
+		for (unsigned int i = 0; i < num_lights; ++i)
+		{
+			const auto& light = light_constants[m_light_list != nullptr ? (*m_light_list)[i] : i];
+			const glm::vec3 toLight = light.lightPos - fragPos;
+			const float distance2 = glm::dot(toLight, toLight);
+			if (distance2 >= light.radius * light.radius)
+				continue;
+
+			glm::vec3 lightDir = glm::normalize(toLight);  // ԴƬεķ
+			glm::vec3 ambient, diffuse, specular;
+			float attenuation = 1.0f;
+			{
+				// ۹ƵĹǿ
+				float theta = glm::dot(lightDir, light.axis);
+				float intensity = glm::clamp((theta - light.cosOuterCutOff) / light.cutOffEpsilon, 0.0f, 1.0f);
+
+				// ⡢䡢淴ļ
+				ambient = amb_color * light.lightColor;
+				diffuse = dif_color * light.lightColor * glm::max(glm::dot(normal, lightDir), 0.0f);
+				glm::vec3 halfwayDir = glm::normalize(viewDir + lightDir);
+				specular = spe_color * light.lightColor * glm::pow(glm::max(glm::dot(normal, halfwayDir), 0.0f), surface.shininess);
+
+				// ǿӦõ;淴
+				diffuse *= intensity;
+				specular *= intensity;
+
+				// Դ˥
+				float distance = glm::length(toLight);
+				attenuation = 1.0f / (light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance);
+
+				//Window the attenuation to 0 at the cut off radius: saturate(1 - (d/r)^4)^2
+				const float ratio2 = distance2 / (light.radius * light.radius);
+				const float window = glm::clamp(1.0f - ratio2 * ratio2, 0.0f, 1.0f);
+				attenuation *= window * window;
+			}
+			// ۼÿԴĹս
+			fragColor.x += (ambient.x + diffuse.x + specular.x) * attenuation;
+			fragColor.y += (ambient.y + diffuse.y + specular.y) * attenuation;
+			fragColor.z += (ambient.z + diffuse.z + specular.z) * attenuation;
+		}
+
+		
+		// ӷ⣨glowЧ
+		fragColor = glm::vec4(fragColor.x + surface.emission.x, fragColor.y + surface.emission.y, fragColor.z + surface.emission.z, surface.alpha);
+		// ɫӳ䣺Ӹ߶̬ΧHDRתΪͶ̬ΧLDR
+		//Tone mapping: HDR -> LDR
+		//Refs: https://learnopengl.com/Advanced-Lighting/HDR
+		{
+			glm::vec3 hdrColor(fragColor);
+			fragColor.x = 1.0f - glm::exp(-hdrColor.x * 2.0f);
+			fragColor.y = 1.0f - glm::exp(-hdrColor.y * 2.0f);
+			fragColor.z = 1.0f - glm::exp(-hdrColor.z * 2.0f);
+		}
+	}
+
+	//----------------------------------------------Rasterization----------------------------------------------
+
+	template<typename DepthFunc, typename FragmentFunc>
+	void TRShadingPipeline::rasterize_wire(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec4 &region,
+		unsigned int varyings,
+		DepthFunc &&depth_test,
+		FragmentFunc &&fragment)
+	{
+		//Draw each line step by step
+		rasterize_wire_aux(v0, v1, region, varyings, depth_test, fragment);
+		rasterize_wire_aux(v1, v2, region, varyings, depth_test, fragment);
+		rasterize_wire_aux(v0, v2, region, varyings, depth_test, fragment);
+	}
+
+	template<unsigned int Samples, typename OcclusionFunc, typename DepthFunc, typename FragmentFunc>
+	void TRShadingPipeline::rasterize_fill_edge_function(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec4 &region,
+		unsigned int varyings,
+		OcclusionFunc &&occluded,
+		DepthFunc &&depth_test,
+		FragmentFunc &&fragment)
+	{
+		static_assert(Samples == 1 || Samples == TR_MSAA_SAMPLES, "Only 1 or TR_MSAA_SAMPLES samples per pixel");
+		VertexData v[] = { v0, v1, v2 };
+		//Edge-equations rasterization algorithm
+		//Note: the edge functions are evaluated with integer arithmetic, so restricting 
+		//      the bounding box to a region gives exactly the same pixels as a full-screen pass.
+		//      With multisampling the screen positions are in 1/TR_SAMPLE_UNITS pixels.
+		const int units = (Samples > 1) ? TR_SAMPLE_UNITS : 1;
+		auto floor_div = [](int a, int b) -> int { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+		glm::ivec2 bounding_min;
+		glm::ivec2 bounding_max;
+		bounding_min.x = std::max(floor_div(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), units), region.x);
+		bounding_min.y = std::max(floor_div(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), units), region.y);
+		bounding_max.x = std::min(floor_div(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)) + units - 1, units), region.z);
+		bounding_max.y = std::min(floor_div(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)) + units - 1, units), region.w);
+
+		//Adjust the order
+		{
+			auto e1 = v1.spos - v0.spos;
+			auto e2 = v2.spos - v0.spos;
+			int orient = e1.x * e2.y - e1.y * e2.x;
+			if (orient > 0)
+			{
+				std::swap(v[1], v[2]);
+			}
+		}
+
+		//Accelerated Half-Space Triangle Rasterization
+		//Refs:Mileff P, Nehz K, Dudra J. Accelerated half-space triangle rasterization[J].
+		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236. http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
+
+		const glm::ivec2 &A = v[0].spos;
+		const glm::ivec2 &B = v[1].spos;
+		const glm::ivec2 &C = v[2].spos;
+
+		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
+		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
+		const int K01 = A.x * B.y - A.y * B.x;
+		const int K02 = B.x * C.y - B.y * C.x;
+		const int K03 = C.x * A.y - C.y * A.x;
+
+		//Note: the sum of three edge functions is constant (twice the triangle area)
+		const int delta = K01 + K02 + K03;
+
+		//Degenerated to a line or a point, or outside the region
+		if (delta == 0 || bounding_min.x > bounding_max.x || bounding_min.y > bounding_max.y)
+			return;
+
+		const float one_div_delta = 1.0f / delta;
+		//Barycentric weight steps of a pixel
+		const float pixel_div_delta = one_div_delta * units;
+
+		//Top left fill rule
+		int E1_t = (((B.y > A.y) || (A.y == B.y && A.x > B.x)) ? 0 : 0);
+		int E2_t = (((C.y > B.y) || (B.y == C.y && B.x > C.x)) ? 0 : 0);
+		int E3_t = (((A.y > C.y) || (C.y == A.y && C.x > A.x)) ? 0 : 0);
+
+		//Hierarchical-Z rejection of the whole triangle
+		//Note: the interpolated depth never goes below the nearest vertex, the epsilon
+		//      covers the rounding error of the floating-point barycentric weights.
+		const float min_depth = std::min(v[0].cpos.z, std::min(v[1].cpos.z, v[2].cpos.z)) - 1e-5f;
+		if (occluded(bounding_min.x, bounding_min.y, bounding_max.x, bounding_max.y, min_depth))
+			return;
+
+		//Multisampling: the sample (ox, oy) of a pixel is inside an edge if E + I * ox + J * oy <= 0, so the
+		//coverage of a sample is the one of the pixel centers with the edge values biased, exact in integers.
+		//Note: a block might only have samples inside, so it's rejected by the smallest bias of every edge.
+		int sample_bias[Samples][3];
+		float sample_dz[Samples];
+		glm::vec2 ddz(0.0f);
+		int block_bias[3] = { E1_t, E2_t, E3_t };
+		if (Samples > 1)
+		{
+			const int Ie[3] = { I01, I02, I03 }, Je[3] = { J01, J02, J03 };
+			const glm::vec2 dz(
+				(I02 * v[0].cpos.z + I03 * v[1].cpos.z + I01 * v[2].cpos.z) * one_div_delta,
+				(J02 * v[0].cpos.z + J03 * v[1].cpos.z + J01 * v[2].cpos.z) * one_div_delta);
+			ddz = dz * static_cast<float>(units);
+			for (unsigned int s = 0; s < Samples; ++s)
+			{
+				const int ox = TR_MSAA_OFFSETS[s][0], oy = TR_MSAA_OFFSETS[s][1];
+				for (int e = 0; e < 3; ++e)
+				{
+					sample_bias[s][e] = Ie[e] * ox + Je[e] * oy;
+					block_bias[e] = (s == 0) ? sample_bias[s][e] : std::min(block_bias[e], sample_bias[s][e]);
+				}
+				sample_dz[s] = dz.x * ox + dz.y * oy;
+			}
+			block_bias[0] += E1_t;
+			block_bias[1] += E2_t;
+			block_bias[2] += E3_t;
+		}
+
+		//Triangle setup: screen space gradients of the attributes (divided by w)
+		//Note: the weights of v[0], v[1], v[2] are E2, E3, E1 over delta, so the gradients are the
+		//      weighted sums with the edge steps, and the planes are anchored at v[0] for precision.
+		VertexData ddx{}, ddy{};
+		{
+			const glm::vec3 wx = glm::vec3(I02, I03, I01) * pixel_div_delta;
+			const glm::vec3 wy = glm::vec3(J02, J03, J01) * pixel_div_delta;
+			ddx.pos = wx.x * v[0].pos + wx.y * v[1].pos + wx.z * v[2].pos;
+			ddy.pos = wy.x * v[0].pos + wy.y * v[1].pos + wy.z * v[2].pos;
+			if (varyings & TR_VARYING_COL)
+			{
+				ddx.col = wx.x * v[0].col + wx.y * v[1].col + wx.z * v[2].col;
+				ddy.col = wy.x * v[0].col + wy.y * v[1].col + wy.z * v[2].col;
+			}
+			if (varyings & TR_VARYING_NOR)
+			{
+				ddx.nor = wx.x * v[0].nor + wx.y * v[1].nor + wx.z * v[2].nor;
+				ddy.nor = wy.x * v[0].nor + wy.y * v[1].nor + wy.z * v[2].nor;
+			}
+			if (varyings & TR_VARYING_TEX)
+			{
+				ddx.tex = wx.x * v[0].tex + wx.y * v[1].tex + wx.z * v[2].tex;
+				ddy.tex = wy.x * v[0].tex + wy.y * v[1].tex + wy.z * v[2].tex;
+			}
+		}
+
+		//The fragment is reused by all the pixels, only the varyings are rewritten
+		VertexData rasterized_point = v[0];
+		rasterized_point.texDx = rasterized_point.texDy = glm::vec2(0.0f);
+		VertexData row_start{};
+
+		//Texture coordinate derivatives of a 2x2 quad (coarse derivatives, like the GPUs)
+		//Note: the quad pixels outside the triangle are extrapolated from the planes,
+		//      and the derivatives are computed once for each quad touched.
+		const bool quad_derivatives = (varyings & TR_VARYING_TEX) != 0;
+		glm::ivec2 last_quad(-1);
+		auto perspective_uv = [&](int x, int y) -> glm::vec2
+		{
+			const float dx = static_cast<float>(x * units - A.x) / units, dy = static_cast<float>(y * units - A.y) / units;
+			const float one_div_w = v[0].pos.w + ddx.pos.w * dx + ddy.pos.w * dy;
+			return (v[0].tex + ddx.tex * dx + ddy.tex * dy) / one_div_w;
+		};
+
+		//Span kernel selected by the runtime CPU detection
+		const TRRasterKernel::SpanFunc span_kernel = TRRasterKernel::getSpanFunc();
+		const int Ix[3] = { I01 * units, I02 * units, I03 * units };
+		const int Jy[3] = { J01 * units, J02 * units, J03 * units };
+		float bary[3 * TRRasterKernel::SPAN_WIDTH];
+
+		//Walk the bounding box in 8x8 blocks
+		constexpr int block_size = TRRasterKernel::SPAN_WIDTH;
+		const int block_min_x = bounding_min.x & ~(block_size - 1);
+		const int block_min_y = bounding_min.y & ~(block_size - 1);
+		for (int by = block_min_y; by <= bounding_max.y; by += block_size)
+		{
+			const int y0 = std::max(by, bounding_min.y);
+			const int y1 = std::min(by + block_size - 1, bounding_max.y);
+			for (int bx = block_min_x; bx <= bounding_max.x; bx += block_size)
+			{
+				const int x0 = std::max(bx, bounding_min.x);
+				const int x1 = std::min(bx + block_size - 1, bounding_max.x);
+				const int ux0 = x0 * units, ux1 = x1 * units, uy0 = y0 * units, uy1 = y1 * units;
+
+				//The block is empty if all of its corners are outside the same edge
+				{
+					auto outside = [&](int I, int J, int K, int E_t) -> bool
+					{
+						return I * ux0 + J * uy0 + K + E_t > 0 && I * ux1 + J * uy0 + K + E_t > 0
+							&& I * ux0 + J * uy1 + K + E_t > 0 && I * ux1 + J * uy1 + K + E_t > 0;
+					};
+					if (outside(I01, J01, K01, block_bias[0]) || outside(I02, J02, K02, block_bias[1]) || outside(I03, J03, K03, block_bias[2]))
+						continue;
+				}
+
+				//Hierarchical-Z rejection of the block
+				if (occluded(x0, y0, x1, y1, min_depth))
+					continue;
+
+				//Evaluate a row of the block at a time with the SIMD kernel
+				//Note: the fill rule bias is folded into the edge values
+				int Cy[3] = {
+					I01 * ux0 + J01 * uy0 + K01 + E1_t,
+					I02 * ux0 + J02 * uy0 + K02 + E2_t,
+					I03 * ux0 + J03 * uy0 + K03 + E3_t };
+				VertexData::planeStep(v[0], ddx, static_cast<float>(ux0 - A.x) / units, varyings, row_start);
+				VertexData::planeStep(row_start, ddy, static_cast<float>(uy0 - A.y) / units, varyings, row_start);
+				for (int y = y0; y <= y1; ++y)
+				{
+					//Coverage of the pixels, with multisampling the pixels having any sample inside
+					unsigned int mask = 0;
+					unsigned int sample_masks[Samples];
+					if (Samples == 1)
+					{
+						mask = span_kernel(Cy, Ix, x1 - x0 + 1, one_div_delta, bary);
+					}
+					else
+					{
+						for (unsigned int s = 0; s < Samples; ++s)
+						{
+							const int Cs[3] = { Cy[0] + sample_bias[s][0], Cy[1] + sample_bias[s][1], Cy[2] + sample_bias[s][2] };
+							sample_masks[s] = span_kernel(Cs, Ix, x1 - x0 + 1, one_div_delta, bary);
+							mask |= sample_masks[s];
+						}
+					}
+					for (int k = 0; mask != 0; ++k, mask >>= 1)
+					{
+						if ((mask & 1u) == 0)
+							continue;
+
+						const int x = x0 + k;
+						//Early depth testing of the samples before the costly attributes interpolation
+						//Note: with multisampling the depth plane is extrapolated from the pixel center
+						float depth[Samples], center_depth;
+						unsigned int coverage = 1;
+						if (Samples == 1)
+						{
+							glm::vec3 uvw(bary[k], bary[k + TRRasterKernel::SPAN_WIDTH], bary[k + 2 * TRRasterKernel::SPAN_WIDTH]);
+							center_depth = depth[0] = uvw.x * v[0].cpos.z + uvw.y * v[1].cpos.z + uvw.z * v[2].cpos.z;
+						}
+						else
+						{
+							center_depth = v[0].cpos.z + (ddz.x * (x * units - A.x) + ddz.y * (y * units - A.y)) / units;
+							coverage = 0;
+							for (unsigned int s = 0; s < Samples; ++s)
+							{
+								coverage |= ((sample_masks[s] >> k) & 1u) << s;
+								depth[s] = center_depth + sample_dz[s];
+							}
+						}
+						const unsigned int passed = depth_test(x, y, depth, coverage);
+						if (passed != 0)
+						{
+							if (varyings != 0)
+							{
+								VertexData::planeStep(row_start, ddx, static_cast<float>(k), varyings, rasterized_point);
+								if (quad_derivatives && (last_quad.x != (x & ~1) || last_quad.y != (y & ~1)))
+								{
+									last_quad = glm::ivec2(x & ~1, y & ~1);
+									const glm::vec2 uv00 = perspective_uv(last_quad.x, last_quad.y);
+									rasterized_point.texDx = perspective_uv(last_quad.x + 1, last_quad.y) - uv00;
+									rasterized_point.texDy = perspective_uv(last_quad.x, last_quad.y + 1) - uv00;
+								}
+								VertexData::aftPrespCorrection(rasterized_point, varyings);
+							}
+							rasterized_point.spos = glm::ivec2(x, y);
+							rasterized_point.cpos.z = center_depth;
+							fragment(rasterized_point, passed, depth);
+						}
+					}
+					Cy[0] += Jy[0]; Cy[1] += Jy[1]; Cy[2] += Jy[2];
+					VertexData::planeStep(row_start, ddy, 1.0f, varyings, row_start);
+				}
+			}
+		}
+
+	}
+
+	template<typename DepthFunc, typename FragmentFunc>
+	void TRShadingPipeline::rasterize_wire_aux(
+		const VertexData &from,
+		const VertexData &to,
+		const glm::ivec4 &region,
+		unsigned int varyings,
+		DepthFunc &&depth_test,
+		FragmentFunc &&fragment)
+	{
+		//Bresenham line rasterization
+
+		int dx = to.spos.x - from.spos.x;
+		int dy = to.spos.y - from.spos.y;
+		int stepX = 1, stepY = 1;
+
+		// judge the sign
+		if (dx < 0)
+		{
+			stepX = -1;
+			dx = -dx;
+		}
+		if (dy < 0)
+		{
+			stepY = -1;
+			dy = -dy;
+		}
+
+		int d2x = 2 * dx, d2y = 2 * dy;
+		int d2y_minus_d2x = d2y - d2x;
+		int sx = from.spos.x;
+		int sy = from.spos.y;
+
+		// slope < 1.
+		if (dy <= dx)
+		{
+			int flag = d2y - dx;
+			for (int i = 0; i <= dx; ++i)
+			{
+				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dx);
+				mid.spos = glm::ivec2(sx, sy);
+				mid.texDx = mid.texDy = glm::vec2(0.0f);
+				if (mid.spos.x >= region.x && mid.spos.x <= region.z && mid.spos.y >= region.y && mid.spos.y <= region.w
+					&& depth_test(mid.spos.x, mid.spos.y, mid.cpos.z))
+				{
+					VertexData::aftPrespCorrection(mid, varyings);
+					fragment(mid);
+				}
+				sx += stepX;
+				if (flag <= 0)
+				{
+					flag += d2y;
+				}
+				else
+				{
+					sy += stepY;
+					flag += d2y_minus_d2x;
+				}
+			}
+		}
+		// slope > 1.
+		else
+		{
+			int flag = d2x - dy;
+			for (int i = 0; i <= dy; ++i)
+			{
+				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dy);
+				mid.spos = glm::ivec2(sx, sy);
+				mid.texDx = mid.texDy = glm::vec2(0.0f);
+				if (mid.spos.x >= region.x && mid.spos.x <= region.z && mid.spos.y >= region.y && mid.spos.y <= region.w
+					&& depth_test(mid.spos.x, mid.spos.y, mid.cpos.z))
+				{
+					VertexData::aftPrespCorrection(mid, varyings);
+					fragment(mid);
+				}
+				sy += stepY;
+				if (flag <= 0)
+				{
+					flag += d2x;
+				}
+				else
+				{
+					sx += stepX;
+					flag -= d2y_minus_d2x;
+				}
+			}
+		}
+	}
 }
 
 #endif
\ No newline at end of file
@@ -15,7 +15,8 @@ namespace TinyRenderer
 	enum TRTextureFilterMode
 	{
 		TR_NEAREST,
-		TR_LINEAR
+		TR_LINEAR,
+		TR_LINEAR_MIPMAP_LINEAR  //Trilinear: bilinear in the two nearest mipmap levels
 	};
 
 	//Polygon mode
@@ -51,6 +52,73 @@ namespace TinyRenderer
 		TR_LIGHTING_ENABLE
 	};
 
+	//Anti-aliasing of the render target
+	enum TRMultisampleMode
+	{
+		TR_MSAA_DISABLE,
+		TR_MSAA_4X  //4 depth and color samples per pixel, shaded once per pixel
+	};
+
+	//Depth prepass: the depth of a tile is rasterized first, then only the visible fragments are shaded
+	enum TRDepthPrepassMode
+	{
+		TR_DEPTH_PREPASS_DISABLE,
+		TR_DEPTH_PREPASS_ENABLE
+	};
+
+	//Deferred shading: the surfaces are rasterized into a G-buffer, then lit by a separate pass
+	enum TRDeferredShadingMode
+	{
+		TR_DEFERRED_SHADING_DISABLE,
+		TR_DEFERRED_SHADING_ENABLE
+	};
+
+	//Sample positions of TR_MSAA_4X relative to the pixel center in 1/TR_SAMPLE_UNITS pixels,
+	//the rotated grid of the GPUs, so no two samples share a row or a column
+	enum { TR_MSAA_SAMPLES = 4, TR_SAMPLE_UNITS = 8 };
+	static const int TR_MSAA_OFFSETS[TR_MSAA_SAMPLES][2] = { { -1, -3 }, { 3, -1 }, { -3, 1 }, { 1, 3 } };
+
+	//Varyings read by the fragment shader (bit mask)
+	enum TRVaryingBit
+	{
+		TR_VARYING_POS = 1 << 0,
+		TR_VARYING_COL = 1 << 1,
+		TR_VARYING_NOR = 1 << 2,
+		TR_VARYING_TEX = 1 << 3,
+		TR_VARYING_ALL = TR_VARYING_POS | TR_VARYING_COL | TR_VARYING_NOR | TR_VARYING_TEX
+	};
+
+	//Shading features of a draw batch (bit mask), the fragment shaders are specialized for each combination
+	enum TRShadingFeatureBit
+	{
+		TR_FEATURE_DIFFUSE_MAP = 1 << 0,
+		TR_FEATURE_SPECULAR_MAP = 1 << 1,
+		TR_FEATURE_GLOW_MAP = 1 << 2,
+		TR_FEATURE_LIGHTING = 1 << 3,
+		TR_FEATURE_ALL = TR_FEATURE_DIFFUSE_MAP | TR_FEATURE_SPECULAR_MAP | TR_FEATURE_GLOW_MAP | TR_FEATURE_LIGHTING,
+		TR_FEATURE_COMBINATIONS = TR_FEATURE_ALL + 1
+	};
+
+	//Compile-time list of all the feature combinations 0, 1, ..., TR_FEATURE_ALL for building dispatch tables
+	template<unsigned int... Features> struct TRFeatureList {};
+	template<unsigned int N, unsigned int... Features>
+	struct TRMakeFeatureList : TRMakeFeatureList<N - 1, N - 1, Features...> {};
+	template<unsigned int... Features>
+	struct TRMakeFeatureList<0, Features...> { typedef TRFeatureList<Features...> type; };
+	typedef TRMakeFeatureList<TR_FEATURE_COMBINATIONS>::type TRAllFeatures;
+
+	//Lighting inputs of a fragment, stored in the G-buffer by the deferred shading
+	struct TRSurface
+	{
+		glm::vec3 position;  //World space
+		glm::vec3 normal;    //World space, normalized
+		glm::vec3 albedo;    //Ambient and diffuse color
+		glm::vec3 specular;
+		glm::vec3 emission;  //Glow color, or the final color of the surfaces that aren't lit
+		float shininess;
+		float alpha;
+	};
+
 	//Point lights
 
 	// ۹ඨ
@@ -0,0 +1,15 @@
+#ifndef TRSIMD_H
+#define TRSIMD_H
+
+//Instruction sets known at compile time, shared by the SIMD paths of the renderer.
+//SSE2 is the baseline of x86-64, so TR_HAS_SSE2 needs no runtime detection (unlike AVX2, see TRRasterKernel.cpp).
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TR_ARCH_X86
+#endif
+
+#if defined(TR_ARCH_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TR_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+#endif
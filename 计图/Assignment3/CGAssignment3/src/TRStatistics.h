@@ -0,0 +1,62 @@
+#ifndef TRSTATISTICS_H
+#define TRSTATISTICS_H
+
+//Pipeline statistics are only collected if TR_ENABLE_STATISTICS is defined (CMake option of the same name),
+//otherwise TR_STAT(...) expands to nothing and the counting costs nothing at all.
+#ifdef TR_ENABLE_STATISTICS
+#define TR_STAT(expr) do { expr; } while (0)
+#else
+#define TR_STAT(expr) do { } while (0)
+#endif
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Counters of a frame collected along the rendering pipeline.
+	 */
+	class TRPipelineStatistics final
+	{
+	public:
+		unsigned long long clusterCulledFaces = 0;   //Faces rejected with their clusters before the vertex shading
+		unsigned long long verticesShaded = 0;       //Vertex shader invocations
+		unsigned long long trianglesAssembled = 0;   //Triangles after clipping, before culling
+		unsigned long long trianglesRasterized = 0;  //Triangles binned for rasterization
+		unsigned long long fragmentsGenerated = 0;   //Covered pixels reaching the depth test
+		unsigned long long fragmentsPassed = 0;      //Fragments passing the depth test, i.e. shaded
+		unsigned long long pixelsShaded = 0;         //Pixels shaded at least once
+		unsigned long long textureSamples = 0;       //texture2D calls
+
+		static constexpr bool isEnabled()
+		{
+#ifdef TR_ENABLE_STATISTICS
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		//Average number of shaded fragments per shaded pixel
+		double getOverdrawRatio() const
+		{
+			return pixelsShaded == 0 ? 0.0 : static_cast<double>(fragmentsPassed) / pixelsShaded;
+		}
+
+		void reset() { *this = TRPipelineStatistics(); }
+
+		TRPipelineStatistics &operator+=(const TRPipelineStatistics &rhs)
+		{
+			clusterCulledFaces += rhs.clusterCulledFaces;
+			verticesShaded += rhs.verticesShaded;
+			trianglesAssembled += rhs.trianglesAssembled;
+			trianglesRasterized += rhs.trianglesRasterized;
+			fragmentsGenerated += rhs.fragmentsGenerated;
+			fragmentsPassed += rhs.fragmentsPassed;
+			pixelsShaded += rhs.pixelsShaded;
+			textureSamples += rhs.textureSamples;
+			return *this;
+		}
+	};
+}
+
+#endif
@@ -1,15 +1,24 @@
 #include "TRTexture2D.h"
+#include "TRSimd.h"
 
+//Note: stb_image writes the failure reason to a global, which races when textures
+//      are decoded concurrently (see TRTextureCache), so the failure strings are disabled
 #define STB_IMAGE_IMPLEMENTATION
+#define STBI_NO_FAILURE_STRINGS
 #include "stb_image.h"
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
+
 namespace TinyRenderer
 {
 	//----------------------------------------------TRTexture2D 23.10.25----------------------------------------------
 
 	TRTexture2D::TRTexture2D() :
-		m_width(0), m_height(0), m_channel(0), m_pixels(nullptr),
+		m_width(0), m_height(0), m_channel(0), m_content_hash(0),
 		m_warp_mode(TRTextureWarpMode::TR_REPEAT),
 		m_filtering_mode(TRTextureFilterMode::TR_NEAREST) {}
 
@@ -31,75 +40,171 @@ namespace TinyRenderer
 
 		//Load image from given file using stb_image.h
 		//Refs: https://github.com/nothings/stb
+		//Note: always expanded to RGBA8, m_channel keeps the number of channels in the file
+		unsigned char *pixels = nullptr;
 		{
-			stbi_set_flip_vertically_on_load(true);
-			m_pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 0);
+			//The flag is a global of stb_image as well, set it only once
+			static const bool flip = []() { stbi_set_flip_vertically_on_load(true); return true; }();
+			(void)flip;
+			pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 4);
 		}
 
-		if (m_pixels == nullptr)
+		if (pixels == nullptr)
 		{
 			std::cerr << "Failed to load image from " << filepath << std::endl;
-			exit(1);
+			freeLoadedImage();
+			return false;
 		}
 
+		buildTexelStorage(pixels);
+		stbi_image_free(pixels);
+
 		return true;
 	}
 
-	void TRTexture2D::readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const
+	void TRTexture2D::buildTexelStorage(const unsigned char *pixels)
 	{
-		//Handling out of range situation
+		//FNV-1a hash of the size and the base level
 		{
-			if (u < 0 || u >= m_width)
+			unsigned long long hash = 14695981039346656037ull;
+			auto mix = [&hash](unsigned char byte) { hash = (hash ^ byte) * 1099511628211ull; };
+			for (int i = 0; i < 4; ++i)
 			{
-				switch (m_warp_mode)
+				mix(static_cast<unsigned char>(m_width >> (8 * i)));
+				mix(static_cast<unsigned char>(m_height >> (8 * i)));
+			}
+			const size_t num_bytes = static_cast<size_t>(m_width) * m_height * 4;
+			for (size_t i = 0; i < num_bytes; ++i)
+			{
+				mix(pixels[i]);
+			}
+			m_content_hash = hash;
+		}
+
+		//Mipmap pyramid in row-major RGBA8 first, each level is a 2x2 box filter of the previous one
+		//Note: the last row/column of an odd sized level is folded into its neighbour
+		struct LinearLevel
+		{
+			int width, height;
+			std::vector<unsigned char> pixels;
+		};
+		std::vector<LinearLevel> linear;
+		linear.push_back({ m_width, m_height, std::vector<unsigned char>(pixels, pixels + m_width * m_height * 4) });
+		while (linear.back().width > 1 || linear.back().height > 1)
+		{
+			const LinearLevel &src = linear.back();
+			LinearLevel dst;
+			dst.width = std::max(src.width / 2, 1);
+			dst.height = std::max(src.height / 2, 1);
+			dst.pixels.resize(dst.width * dst.height * 4);
+			for (int y = 0; y < dst.height; ++y)
+			{
+				const int y0 = std::min(2 * y, src.height - 1);
+				const int y1 = std::min(2 * y + 1, src.height - 1);
+				for (int x = 0; x < dst.width; ++x)
 				{
-				case TRTextureWarpMode::TR_REPEAT:
-					u = u > 0 ? (u % m_width) : (m_width - 1 + u % m_width);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
-				default:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
+					const int x0 = std::min(2 * x, src.width - 1);
+					const int x1 = std::min(2 * x + 1, src.width - 1);
+					const unsigned char *p00 = &src.pixels[(y0 * src.width + x0) * 4];
+					const unsigned char *p01 = &src.pixels[(y0 * src.width + x1) * 4];
+					const unsigned char *p10 = &src.pixels[(y1 * src.width + x0) * 4];
+					const unsigned char *p11 = &src.pixels[(y1 * src.width + x1) * 4];
+					unsigned char *p = &dst.pixels[(y * dst.width + x) * 4];
+					for (int c = 0; c < 4; ++c)
+					{
+						p[c] = static_cast<unsigned char>((p00[c] + p01[c] + p10[c] + p11[c] + 2) >> 2);
+					}
 				}
 			}
+			linear.push_back(std::move(dst));
+		}
 
-			if (v < 0 || v >= m_height)
+		//Swizzle all the levels into 4x4 blocks of one buffer aligned to the cache line
+		size_t total = 0;
+		for (const auto &level : linear)
+		{
+			const size_t blocks_x = (level.width + m_block_size - 1) / m_block_size;
+			const size_t blocks_y = (level.height + m_block_size - 1) / m_block_size;
+			total += blocks_x * blocks_y * m_block_size * m_block_size;
+		}
+		constexpr size_t align = 64 / sizeof(unsigned int);
+		m_texels.assign(total + align - 1, 0u);
+		const uintptr_t base = reinterpret_cast<uintptr_t>(m_texels.data());
+		unsigned int *dst = m_texels.data() + ((64 - base % 64) % 64) / sizeof(unsigned int);
+
+		m_levels.clear();
+		for (const auto &level : linear)
+		{
+			MipLevel mip;
+			mip.width = level.width;
+			mip.height = level.height;
+			mip.blocksX = (level.width + m_block_size - 1) / m_block_size;
+			mip.texels = dst;
+			for (int y = 0; y < level.height; ++y)
 			{
-				switch (m_warp_mode)
+				for (int x = 0; x < level.width; ++x)
 				{
-				case TRTextureWarpMode::TR_REPEAT:
-					v = v > 0 ? (v % m_height) : (m_height - 1 + v % m_height);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
-				default:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
+					std::memcpy(&dst[texelIndex(mip, x, y)], &level.pixels[(y * level.width + x) * 4], 4);
 				}
 			}
+			const int blocks_y = (level.height + m_block_size - 1) / m_block_size;
+			dst += mip.blocksX * blocks_y * m_block_size * m_block_size;
+			m_levels.push_back(mip);
+		}
+	}
+
+	int TRTexture2D::wrapCoord(int c, int size) const
+	{
+		//Handling out of range situation
+		if (c >= 0 && c < size)
+			return c;
+		switch (m_warp_mode)
+		{
+		case TRTextureWarpMode::TR_REPEAT:
+			return (c % size + size) % size;
+		case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
+			return (c < 0) ? 0 : size - 1;
+		default:
+			return (c < 0) ? 0 : size - 1;
 		}
+	}
+
+	void TRTexture2D::readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a, int level) const
+	{
+		const MipLevel &mip = m_levels[level];
+		u = wrapCoord(u, mip.width);
+		v = wrapCoord(v, mip.height);
 
-		int index = (v * m_height + u) * m_channel;
-		r = m_pixels[index + 0];
-		g = m_pixels[index + 1];
-		b = m_pixels[index + 2];
-		a = (m_channel >= 4) ? m_pixels[index + 3] : a;
+		const unsigned int texel = mip.texels[texelIndex(mip, u, v)];
+		const unsigned char *rgba = reinterpret_cast<const unsigned char*>(&texel);
+		r = rgba[0];
+		g = rgba[1];
+		b = rgba[2];
+		a = rgba[3];
 
 		return;
 	}
 
-	void TRTexture2D::freeLoadedImage()
+	bool TRTexture2D::hasSameContent(const TRTexture2D &rhs) const
 	{
-		if (m_pixels != nullptr)
-		{
-			stbi_image_free(m_pixels);
-		}
+		if (m_width != rhs.m_width || m_height != rhs.m_height || m_content_hash != rhs.m_content_hash)
+			return false;
+		if (m_levels.empty() || rhs.m_levels.empty())
+			return m_levels.empty() && rhs.m_levels.empty();
+
+		//The base level is followed by the others, so it spans up to the first mipmap level
+		const MipLevel &base = m_levels[0];
+		const int blocks_y = (base.height + m_block_size - 1) / m_block_size;
+		const size_t count = static_cast<size_t>(base.blocksX) * blocks_y * m_block_size * m_block_size;
+		return std::memcmp(base.texels, rhs.m_levels[0].texels, count * sizeof(unsigned int)) == 0;
+	}
 
-		m_pixels = nullptr;
+	void TRTexture2D::freeLoadedImage()
+	{
 		m_width = m_height = m_channel = 0;
+		m_content_hash = 0;
+		m_levels.clear();
+		m_texels.clear();
 	}
 
 	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv) const
@@ -113,6 +218,8 @@ namespace TinyRenderer
 			texel = TRTexture2DSampler::textureSampling_nearest(*this, uv);
 			break;
 		case TRTextureFilterMode::TR_LINEAR:
+		case TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR:
+			//Note: no derivatives, so the base level is sampled
 			texel = TRTexture2DSampler::textureSampling_bilinear(*this, uv);
 			break;
 		default:
@@ -122,6 +229,23 @@ namespace TinyRenderer
 		return texel;
 	}
 
+	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
+	{
+		if (m_filtering_mode != TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR)
+			return sample(uv);
+		return TRTexture2DSampler::textureSampling_trilinear(*this, uv, computeLod(dUVdx, dUVdy));
+	}
+
+	float TRTexture2D::computeLod(const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const
+	{
+		//Refs: OpenGL 4.6 specification, 8.14.1 Scale Factor and Level of Detail
+		const glm::vec2 size(m_width, m_height);
+		const glm::vec2 dx = dUVdx * size, dy = dUVdy * size;
+		const float rho2 = std::max(glm::dot(dx, dx), glm::dot(dy, dy));
+		//log2(rho) = 0.5 * log2(rho^2), and NaN (rho2 > 0 fails) goes to the base level
+		return (rho2 > 1.0f) ? 0.5f * std::log2(rho2) : 0.0f;
+	}
+
 	//----------------------------------------------TRTexture2DSampler----------------------------------------------
 
 	glm::vec4 TRTexture2DSampler::textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv)
@@ -146,50 +270,89 @@ namespace TinyRenderer
 		return glm::vec4(r, g, b, a) * denom;
 	}
 
-	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv)
+	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level)
 	{
 		//Note: Delete this line when you try to implement Task 4. 
 		//return textureSampling_nearest(texture, uv);
+		const int width = texture.m_levels[level].width;
+		const int height = texture.m_levels[level].height;
+
 		//  uv ӳ䵽귶Χ [0, width-1]  [0, height-1]
-		float x = uv.x * (texture.getWidth() - 1);
-		float y = uv.y * (texture.getHeight() - 1);
+		float x = uv.x * (width - 1);
+		float y = uv.y * (height - 1);
 
 		// ȡֺС
 		int x0 = static_cast<int>(std::floor(x)); // ½ x 
 		int y0 = static_cast<int>(std::floor(y)); // ½ y 
-		int x1 = std::min(x0 + 1, texture.getWidth() - 1); // ½ x 
-		int y1 = std::min(y0 + 1, texture.getHeight() - 1); // Ͻ y 
+		float tx = x - x0; // Сֵ֣ӣ
+		float ty = y - y0; // Сֵ֣ӣ
 
-		// ȡĸڽص RGBA ֵ
-		unsigned char r0, g0, b0, a0; // ½
-		unsigned char r1, g1, b1, a1; // ½
-		unsigned char r2, g2, b2, a2; // Ͻ
-		unsigned char r3, g3, b3, a3; // Ͻ
+		//The 2x2 footprint, wrapped or clamped according to the warping mode
+		const TRTexture2D::MipLevel &mip = texture.m_levels[level];
+		const int u0 = texture.wrapCoord(x0, width), u1 = texture.wrapCoord(x0 + 1, width);
+		const int v0 = texture.wrapCoord(y0, height), v1 = texture.wrapCoord(y0 + 1, height);
+		const unsigned int t0 = mip.texels[TRTexture2D::texelIndex(mip, u0, v0)]; // ½
+		const unsigned int t1 = mip.texels[TRTexture2D::texelIndex(mip, u1, v0)]; // ½
+		const unsigned int t2 = mip.texels[TRTexture2D::texelIndex(mip, u0, v1)]; // Ͻ
+		const unsigned int t3 = mip.texels[TRTexture2D::texelIndex(mip, u1, v1)]; // Ͻ
 
-		texture.readPixel(x0, y0, r0, g0, b0, a0);
-		texture.readPixel(x1, y0, r1, g1, b1, a1);
-		texture.readPixel(x0, y1, r2, g2, b2, a2);
-		texture.readPixel(x1, y1, r3, g3, b3, a3);
+		constexpr float denom = 1.0f / 255.0f;
+#ifdef TR_HAS_SSE2
+		//Unpack the four RGBA8 texels at once, then the same operations as glm::mix,
+		//i.e. a * (1 - t) + b * t, so the result equals the scalar path bit by bit
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i packed = _mm_setr_epi32(static_cast<int>(t0), static_cast<int>(t1), static_cast<int>(t2), static_cast<int>(t3));
+		const __m128i lo = _mm_unpacklo_epi8(packed, zero);
+		const __m128i hi = _mm_unpackhi_epi8(packed, zero);
+		const __m128 color0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+		const __m128 color1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		const __m128 color2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+		const __m128 color3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+
+		const __m128 sx = _mm_set1_ps(tx), rx = _mm_set1_ps(1.0f - tx);
+		const __m128 sy = _mm_set1_ps(ty), ry = _mm_set1_ps(1.0f - ty);
+		const __m128 hInterp0 = _mm_add_ps(_mm_mul_ps(color0, rx), _mm_mul_ps(color1, sx));
+		const __m128 hInterp1 = _mm_add_ps(_mm_mul_ps(color2, rx), _mm_mul_ps(color3, sx));
+		const __m128 finalColor = _mm_add_ps(_mm_mul_ps(hInterp0, ry), _mm_mul_ps(hInterp1, sy));
+
+		glm::vec4 texel;
+		_mm_storeu_ps(&texel.x, _mm_mul_ps(finalColor, _mm_set1_ps(denom)));
+		return texel;
+#else
+		auto unpack = [](unsigned int t) -> glm::vec4
+		{
+			const unsigned char *rgba = reinterpret_cast<const unsigned char*>(&t);
+			return glm::vec4(rgba[0], rgba[1], rgba[2], rgba[3]);
+		};
 
 		// ˮƽֵ
-		float tx = x - x0; // Сֵ֣ӣ
-		glm::vec4 color0(r0, g0, b0, a0); // ½ɫ
-		glm::vec4 color1(r1, g1, b1, a1); // ½ɫ
-		glm::vec4 color2(r2, g2, b2, a2); // Ͻɫ
-		glm::vec4 color3(r3, g3, b3, a3); // Ͻɫ
-
-		glm::vec4 hInterp0 = glm::mix(color0, color1, tx); // ֮Ĳֵ
-		glm::vec4 hInterp1 = glm::mix(color2, color3, tx); // ֮Ĳֵ
+		glm::vec4 hInterp0 = glm::mix(unpack(t0), unpack(t1), tx); // ֮Ĳֵ
+		glm::vec4 hInterp1 = glm::mix(unpack(t2), unpack(t3), tx); // ֮Ĳֵ
 
 		// 㴹ֱֵ
-		float ty = y - y0; // Сֵ֣ӣ
 		glm::vec4 finalColor = glm::mix(hInterp0, hInterp1, ty); // յĲֵ
 
 		// һ RGBA ֵ [0, 1] Χ
-		constexpr float denom = 1.0f / 255.0f;
 		return finalColor * denom;
+#endif
 		//Improvement: Implement bilinear sampling algorithm for texture sampling
 		// Note: You should use texture.readPixel() to read the pixel, and for instance, 
 		//       use texture.readPixel(25,35,r,g,b,a) to read the pixel in (25, 35).
 	}
+	glm::vec4 TRTexture2DSampler::textureSampling_trilinear(const TRTexture2D &texture, glm::vec2 uv, float lod)
+	{
+		//Magnification, or a texture without mipmaps
+		const int max_level = texture.getNumLevels() - 1;
+		if (lod <= 0.0f || max_level <= 0)
+			return textureSampling_bilinear(texture, uv, 0);
+
+		//Minification: blend the two nearest levels
+		if (lod >= static_cast<float>(max_level))
+			return textureSampling_bilinear(texture, uv, max_level);
+		const int level = static_cast<int>(lod);
+		const float frac = lod - level;
+		return glm::mix(
+			textureSampling_bilinear(texture, uv, level),
+			textureSampling_bilinear(texture, uv, level + 1), frac);
+	}
 }
\ No newline at end of file
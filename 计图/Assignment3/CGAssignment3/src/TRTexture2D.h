@@ -3,6 +3,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "glm/glm.hpp"
 #include "TRShadingState.h"
@@ -17,6 +18,10 @@ namespace TinyRenderer
 		TRTexture2D();
 		~TRTexture2D();
 
+		//The mipmap levels point into m_texels, a copy would point into the source
+		TRTexture2D(const TRTexture2D&) = delete;
+		TRTexture2D& operator=(const TRTexture2D&) = delete;
+
 		//Sampling options setting
 		void setWarpingMode(TRTextureWarpMode mode);
 		void setFilteringMode(TRTextureFilterMode mode);
@@ -24,7 +29,17 @@ namespace TinyRenderer
 		int getWidth() const { return m_width; }
 		int getHeight() const { return m_height; }
 		int getChannel() const { return m_channel; }
+		int getNumLevels() const { return static_cast<int>(m_levels.size()); }
+		TRTextureWarpMode getWarpingMode() const { return m_warp_mode; }
+		TRTextureFilterMode getFilteringMode() const { return m_filtering_mode; }
+
+		//Memory footprint of the texels (all the mipmap levels)
+		size_t getMemoryBytes() const { return m_texels.size() * sizeof(unsigned int); }
+		//Hash of the image content (size and base level texels), for deduplication
+		unsigned long long getContentHash() const { return m_content_hash; }
+		bool hasSameContent(const TRTexture2D &rhs) const;
 
+		//Return false and leave the texture empty if the file can't be loaded
 		bool loadTextureFromFile(
 			const std::string &filepath,
 			TRTextureWarpMode warpMode = TRTextureWarpMode::TR_REPEAT,
@@ -32,15 +47,41 @@ namespace TinyRenderer
 
 		//Sampling according to the given uv coordinate
 		glm::vec4 sample(const glm::vec2 &uv) const;
+		//Sampling with the screen space derivatives of uv, which select the mipmap level
+		glm::vec4 sample(const glm::vec2 &uv, const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const;
+
+		//Level of detail of the given screen space derivatives of uv
+		float computeLod(const glm::vec2 &dUVdx, const glm::vec2 &dUVdy) const;
 
 	private:
+		//Level 0 is the loaded image, the others are 2x2 box filtered down to 1x1.
+		//Texels are RGBA8 stored in 4x4 blocks (64 bytes, one cache line), row-major blocks 
+		//and row-major texels inside a block, so a bilinear footprint rarely spans two lines.
+		struct MipLevel
+		{
+			int width, height;
+			int blocksX;
+			const unsigned int *texels;
+		};
+
+		enum { m_block_size = 4 };
+
+		static int texelIndex(const MipLevel &mip, int u, int v)
+		{
+			return (((v >> 2) * mip.blocksX + (u >> 2)) << 4) | ((v & 3) << 2) | (u & 3);
+		}
+
 		//Auxiliary functions
-		void readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const;
+		int wrapCoord(int c, int size) const;
+		void readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a, int level = 0) const;
+		void buildTexelStorage(const unsigned char *pixels);
 		void freeLoadedImage();
 
 	private:
 		int m_width, m_height, m_channel;
-		unsigned char *m_pixels;
+		std::vector<MipLevel> m_levels;
+		std::vector<unsigned int> m_texels;
+		unsigned long long m_content_hash;
 
 		TRTextureWarpMode m_warp_mode;
 		TRTextureFilterMode m_filtering_mode;
@@ -54,7 +95,8 @@ namespace TinyRenderer
 
 		//Sampling algorithm
 		static glm::vec4 textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv);
-		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv);
+		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level = 0);
+		static glm::vec4 textureSampling_trilinear(const TRTexture2D &texture, glm::vec2 uv, float lod);
 	};
 }
 
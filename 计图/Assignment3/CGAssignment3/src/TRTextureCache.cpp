@@ -0,0 +1,209 @@
+#include "TRTextureCache.h"
+
+#include <sstream>
+#include <iterator>
+
+namespace TinyRenderer
+{
+	//----------------------------------------------TRTextureCache----------------------------------------------
+
+	int TRTextureCache::load(const std::string &filepath, TRTextureWarpMode warpMode, TRTextureFilterMode filterMode)
+	{
+		const std::string key = makePathKey(filepath, warpMode, filterMode);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_path_index.find(key);
+			if (it != m_path_index.end())
+			{
+				++m_entries[it->second].refCount;
+				return it->second;
+			}
+		}
+
+		//Decode outside the lock, so that different textures can be loaded concurrently
+		TRTexture2D::ptr tex = std::make_shared<TRTexture2D>();
+		if (!tex->loadTextureFromFile(filepath, warpMode, filterMode))
+			return -1;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		//The same file might be loaded by another thread in the meantime
+		auto it = m_path_index.find(key);
+		if (it != m_path_index.end())
+		{
+			++m_entries[it->second].refCount;
+			return it->second;
+		}
+
+		//Same image under another path
+		int id = findContent(*tex);
+		if (id != -1)
+			++m_entries[id].refCount;
+		else
+			id = insert(tex);
+
+		m_path_index.insert({ key, id });
+		return id;
+	}
+
+	int TRTextureCache::upload(TRTexture2D::ptr tex)
+	{
+		if (tex == nullptr)
+			return -1;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		int id = findContent(*tex);
+		if (id != -1)
+		{
+			++m_entries[id].refCount;
+			return id;
+		}
+		return insert(tex);
+	}
+
+	void TRTextureCache::retain(int id)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (id >= 0 && id < static_cast<int>(m_entries.size()) && m_entries[id].texture != nullptr)
+			++m_entries[id].refCount;
+	}
+
+	void TRTextureCache::release(int id)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (id >= 0 && id < static_cast<int>(m_entries.size()) && m_entries[id].refCount > 0)
+			--m_entries[id].refCount;
+	}
+
+	size_t TRTextureCache::evictUnused()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		size_t num_evicted = 0;
+		for (int id = 0; id < static_cast<int>(m_entries.size()); ++id)
+		{
+			Entry &entry = m_entries[id];
+			if (entry.texture == nullptr || entry.refCount > 0)
+				continue;
+
+			//Drop all the paths and the content key referring to it
+			for (auto it = m_path_index.begin(); it != m_path_index.end();)
+			{
+				it = (it->second == id) ? m_path_index.erase(it) : std::next(it);
+			}
+			auto range = m_content_index.equal_range(entry.contentKey);
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				if (it->second == id)
+				{
+					m_content_index.erase(it);
+					break;
+				}
+			}
+
+			entry = Entry();
+			m_free_ids.push_back(id);
+			++num_evicted;
+		}
+		return num_evicted;
+	}
+
+	TRTexture2D::ptr TRTextureCache::getPtr(int id) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return (id < 0 || id >= static_cast<int>(m_entries.size())) ? nullptr : m_entries[id].texture;
+	}
+
+	int TRTextureCache::getRefCount(int id) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return (id < 0 || id >= static_cast<int>(m_entries.size())) ? 0 : m_entries[id].refCount;
+	}
+
+	size_t TRTextureCache::getNumTextures() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_entries.size() - m_free_ids.size();
+	}
+
+	size_t TRTextureCache::getResidentBytes() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		size_t bytes = 0;
+		for (const auto &entry : m_entries)
+		{
+			if (entry.texture != nullptr)
+				bytes += entry.texture->getMemoryBytes();
+		}
+		return bytes;
+	}
+
+	int TRTextureCache::findContent(const TRTexture2D &tex) const
+	{
+		//Note: the hash only narrows the candidates, the texels are compared for real
+		auto range = m_content_index.equal_range(tex.getContentHash());
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			const TRTexture2D &cached = *m_entries[it->second].texture;
+			if (cached.getWarpingMode() == tex.getWarpingMode() &&
+				cached.getFilteringMode() == tex.getFilteringMode() &&
+				cached.hasSameContent(tex))
+			{
+				return it->second;
+			}
+		}
+		return -1;
+	}
+
+	int TRTextureCache::insert(TRTexture2D::ptr tex)
+	{
+		//Reuse the slots of the evicted textures first
+		int id;
+		if (!m_free_ids.empty())
+		{
+			id = m_free_ids.back();
+			m_free_ids.pop_back();
+		}
+		else
+		{
+			id = static_cast<int>(m_entries.size());
+			m_entries.push_back(Entry());
+		}
+
+		Entry &entry = m_entries[id];
+		entry.texture = tex;
+		entry.refCount = 1;
+		entry.contentKey = tex->getContentHash();
+		m_content_index.insert({ entry.contentKey, id });
+		return id;
+	}
+
+	std::string TRTextureCache::makePathKey(const std::string &filepath, TRTextureWarpMode warpMode, TRTextureFilterMode filterMode)
+	{
+		//Lexically normalized path: unified separators, no "." and resolved ".."
+		std::vector<std::string> parts;
+		std::string part;
+		std::stringstream ss(filepath);
+		while (std::getline(ss, part, '/'))
+		{
+			std::stringstream sub(part);
+			std::string name;
+			while (std::getline(sub, name, '\\'))
+			{
+				if (name.empty() || name == ".")
+					continue;
+				if (name == ".." && !parts.empty() && parts.back() != "..")
+					parts.pop_back();
+				else
+					parts.push_back(name);
+			}
+		}
+
+		std::string key = (!filepath.empty() && (filepath[0] == '/' || filepath[0] == '\\')) ? "/" : "";
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			key += (i == 0 ? "" : "/") + parts[i];
+		}
+		return key + "#" + std::to_string(static_cast<int>(warpMode)) + "#" + std::to_string(static_cast<int>(filterMode));
+	}
+}
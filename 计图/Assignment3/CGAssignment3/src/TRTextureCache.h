@@ -0,0 +1,70 @@
+#ifndef TRTEXTURECACHE_H
+#define TRTEXTURECACHE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "TRTexture2D.h"
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Texture units of a render context. Textures are deduplicated by the file path
+	 *                (before decoding) and by the image content (after decoding), and reference counted:
+	 *                load/upload/retain add a reference, release removes one, and evictUnused frees the
+	 *                textures without any reference. The id of a texture never changes while referenced.
+	 * @note          The management functions are thread safe, get() is not synchronized with them,
+	 *                so don't load or evict while rendering.
+	 */
+	class TRTextureCache final
+	{
+	public:
+
+		//Load the texture from file or return the cached one, -1 if it fails
+		int load(const std::string &filepath, TRTextureWarpMode warpMode, TRTextureFilterMode filterMode);
+
+		//Add a loaded texture, an existing texture with the same content and sampling modes is reused
+		int upload(TRTexture2D::ptr tex);
+
+		void retain(int id);
+		void release(int id);
+
+		//Free the textures without any reference, return the number of freed textures
+		size_t evictUnused();
+
+		const TRTexture2D *get(int id) const
+		{
+			return (id < 0 || id >= static_cast<int>(m_entries.size())) ? nullptr : m_entries[id].texture.get();
+		}
+		TRTexture2D::ptr getPtr(int id) const;
+
+		int getRefCount(int id) const;
+		size_t getNumTextures() const;
+		size_t getResidentBytes() const;
+
+	private:
+		struct Entry
+		{
+			TRTexture2D::ptr texture;
+			int refCount = 0;
+			unsigned long long contentKey = 0;
+		};
+
+		int findContent(const TRTexture2D &tex) const;
+		int insert(TRTexture2D::ptr tex);
+
+		static std::string makePathKey(const std::string &filepath, TRTextureWarpMode warpMode, TRTextureFilterMode filterMode);
+
+	private:
+		std::vector<Entry> m_entries;
+		std::vector<int> m_free_ids;
+		std::unordered_map<std::string, int> m_path_index;
+		std::unordered_multimap<unsigned long long, int> m_content_index;
+		mutable std::mutex m_mutex;
+	};
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "TRThreadPool.h"
+
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	//Pool and slot of the job the current thread is executing, nullptr and -1 if none
+	static thread_local const TRThreadPool *t_job_pool = nullptr;
+	static thread_local int t_job_slot = -1;
+
+	TRThreadPool::TRThreadPool(int num_threads)
+		: m_next_index(0)
+	{
+		if (num_threads <= 0)
+		{
+			num_threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		//The calling thread is the slot 0, so we only spawn num_threads - 1 workers
+		for (int slot = 1; slot < num_threads; ++slot)
+		{
+			m_workers.emplace_back(&TRThreadPool::workerLoop, this, slot);
+		}
+	}
+
+	TRThreadPool::~TRThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_start_cond.notify_all();
+		for (auto &worker : m_workers)
+		{
+			worker.join();
+		}
+	}
+
+	void TRThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)> &func)
+	{
+		if (begin >= end)
+			return;
+
+		//Serial path: no workers or nested invocation from a job of this pool, which keeps the slot of the calling job.
+		//A nested call from a job of another pool fans out on this pool, that slot means nothing here.
+		const bool nested = (t_job_pool == this);
+		if (m_workers.empty() || nested)
+		{
+			const int slot = nested ? t_job_slot : 0;
+			for (int i = begin; i < end; ++i)
+			{
+				func(i, slot);
+			}
+			return;
+		}
+
+		std::lock_guard<std::mutex> job_lock(m_job_mutex);
+
+		//Publish the job
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_job = &func;
+			m_next_index.store(begin);
+			m_end_index = end;
+			m_num_busy = static_cast<int>(m_workers.size());
+			++m_generation;
+		}
+		m_start_cond.notify_all();
+
+		//The calling thread works as well
+		runJob(0);
+
+		//Wait for the workers
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done_cond.wait(lock, [this]() { return m_num_busy == 0; });
+			m_job = nullptr;
+		}
+	}
+
+	TRThreadPool::ptr TRThreadPool::getDefault()
+	{
+		static TRThreadPool::ptr pool = std::make_shared<TRThreadPool>();
+		return pool;
+	}
+
+	void TRThreadPool::workerLoop(int slot)
+	{
+		unsigned int last_generation = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_start_cond.wait(lock, [&]() { return m_quit || m_generation != last_generation; });
+				if (m_quit)
+					return;
+				last_generation = m_generation;
+			}
+
+			runJob(slot);
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				--m_num_busy;
+			}
+			m_done_cond.notify_one();
+		}
+	}
+
+	void TRThreadPool::runJob(int slot)
+	{
+		//The calling thread may already run a job of another pool, restore it afterwards
+		const TRThreadPool *outer_pool = t_job_pool;
+		const int outer_slot = t_job_slot;
+		t_job_pool = this;
+		t_job_slot = slot;
+		const auto &func = *m_job;
+		for (int i = m_next_index.fetch_add(1); i < m_end_index; i = m_next_index.fetch_add(1))
+		{
+			func(i, slot);
+		}
+		t_job_pool = outer_pool;
+		t_job_slot = outer_slot;
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef TRTHREADPOOL_H
+#define TRTHREADPOOL_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         A tiny fork-join thread pool.
+	 *                The calling thread always takes part in the job as thread slot 0,
+	 *                the worker threads use the slots [1, getNumberOfThreads()).
+	 */
+	class TRThreadPool final
+	{
+	public:
+		typedef std::shared_ptr<TRThreadPool> ptr;
+
+		//Note: num_threads counts the calling thread, 0 means hardware concurrency
+		explicit TRThreadPool(int num_threads = 0);
+		~TRThreadPool();
+
+		TRThreadPool(const TRThreadPool&) = delete;
+		TRThreadPool& operator=(const TRThreadPool&) = delete;
+
+		int getNumberOfThreads() const { return static_cast<int>(m_workers.size()) + 1; }
+
+		//Invoke func(index, slot) for every index in [begin, end) and block until all are done.
+		//Indices are handed out dynamically, so an uneven work distribution is fine.
+		//Note: a nested call from inside a job of this pool just runs serially, func gets the slot of the calling job.
+		//      A nested call from inside a job of another pool fans out on this pool as usual.
+		void parallelFor(int begin, int end, const std::function<void(int, int)> &func);
+
+		//Process-wide pool for the jobs that don't belong to a renderer (e.g. mesh loading)
+		static TRThreadPool::ptr getDefault();
+
+	private:
+		void workerLoop(int slot);
+		void runJob(int slot);
+
+	private:
+		std::vector<std::thread> m_workers;
+
+		//Only one job is in flight at a time
+		std::mutex m_job_mutex;
+
+		std::mutex m_mutex;
+		std::condition_variable m_start_cond;
+		std::condition_variable m_done_cond;
+		const std::function<void(int, int)> *m_job = nullptr;
+		std::atomic<int> m_next_index;
+		int m_end_index = 0;
+		int m_num_busy = 0;
+		unsigned int m_generation = 0;
+		bool m_quit = false;
+	};
+}
+
+#endif
@@ -1,9 +1,41 @@
 #include "TRWindowsApp.h"
+#include "TRSimd.h"
 
 #include <iostream>
 #include <iomanip>
+#include <cstring>
+#include <algorithm>
+
 namespace TinyRenderer
 {
+	//Copy count RGBA8 pixels swapping the red and blue bytes
+	static void copySwapRedBlue(Uint32 *dst, const unsigned char *src, int count)
+	{
+		int i = 0;
+#ifdef TR_HAS_SSE2
+		//x86 is little endian, so a pixel reads as 0xAABBGGRR
+		const __m128i maskAG = _mm_set1_epi32(static_cast<int>(0xFF00FF00u));
+		const __m128i maskB = _mm_set1_epi32(0x000000FF);
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			const __m128i r = _mm_slli_epi32(_mm_and_si128(p, maskB), 16);
+			const __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), maskB);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+				_mm_or_si128(_mm_and_si128(p, maskAG), _mm_or_si128(r, b)));
+		}
+#endif
+		unsigned char *out = reinterpret_cast<unsigned char*>(dst);
+		for (; i < count; ++i)
+		{
+			out[i * 4 + 0] = src[i * 4 + 2];
+			out[i * 4 + 1] = src[i * 4 + 1];
+			out[i * 4 + 2] = src[i * 4 + 0];
+			out[i * 4 + 3] = src[i * 4 + 3];
+		}
+	}
+
+
 	TRWindowsApp::ptr TRWindowsApp::m_instance = nullptr;
 
 	bool TRWindowsApp::setup(int width, int height, std::string title)
@@ -42,11 +74,41 @@ namespace TinyRenderer
 		//Get window surface
 		m_screen_surface = SDL_GetWindowSurface(m_window_handle);
 
+		//Match the surface layout against the RGBA8 bytes of the color buffer
+		{
+			const unsigned char red[4] = { 255, 0, 0, 0 }, green[4] = { 0, 255, 0, 0 }, blue[4] = { 0, 0, 255, 0 };
+			Uint32 rmask, gmask, bmask;
+			std::memcpy(&rmask, red, 4);
+			std::memcpy(&gmask, green, 4);
+			std::memcpy(&bmask, blue, 4);
+
+			const SDL_PixelFormat *format = m_screen_surface->format;
+			if (format->BytesPerPixel == 4 && format->Gmask == gmask && format->Rmask == rmask && format->Bmask == bmask)
+				m_blit_mode = TRBlitMode::TR_BLIT_COPY;
+			else if (format->BytesPerPixel == 4 && format->Gmask == gmask && format->Rmask == bmask && format->Bmask == rmask)
+				m_blit_mode = TRBlitMode::TR_BLIT_SWAP_RB;
+			else
+				m_blit_mode = TRBlitMode::TR_BLIT_MAP_RGB;
+		}
+
+		m_present_thread = std::thread(&TRWindowsApp::presentLoop, this);
+
 		return true;
 	}
 
 	TRWindowsApp::~TRWindowsApp()
 	{
+		//Stop the present thread
+		if (m_present_thread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_present_mutex);
+				m_present_exit = true;
+			}
+			m_present_cond.notify_all();
+			m_present_thread.join();
+		}
+
 		//Destroy window
 		SDL_DestroyWindow(m_window_handle);
 		m_window_handle = nullptr;
@@ -123,22 +185,26 @@ namespace TinyRenderer
 		unsigned int num_cliped_faces,
 		unsigned int num_culled_faces)
 	{
-		//Update pixels
-		SDL_LockSurface(m_screen_surface);
+		//Show the previous frame, copied by the present thread in the meantime
+		waitForPresent();
+		if (m_present_copied)
+			SDL_UpdateWindowSurface(m_window_handle);
+
+		//Copy this frame while the next one is rendered
+		//Note: not when closing, the pixels might be freed before the copy ends
+		if (!m_quit)
 		{
-			Uint32* destPixels = (Uint32*)m_screen_surface->pixels;
-			for (int i = 0; i < width * height; ++i)
 			{
-				Uint32 color = SDL_MapRGB(
-					m_screen_surface->format, 
-					static_cast<uint8_t>(pixels[i * channel + 0]),
-					static_cast<uint8_t>(pixels[i * channel + 1]),
-					static_cast<uint8_t>(pixels[i * channel + 2]));
-				destPixels[i] = color;
+				std::lock_guard<std::mutex> lock(m_present_mutex);
+				m_present_pixels = pixels;
+				m_present_width = width;
+				m_present_height = height;
+				m_present_channel = channel;
+				m_present_pending = true;
 			}
+			m_present_cond.notify_all();
+			m_present_copied = true;
 		}
-		SDL_UnlockSurface(m_screen_surface);
-		SDL_UpdateWindowSurface(m_window_handle);
 
 		m_delta_time = m_timer.getTicks() - m_last_time_point;
 		m_last_time_point = m_timer.getTicks();
@@ -164,6 +230,64 @@ namespace TinyRenderer
 		return m_delta_time;
 	}
 
+	void TRWindowsApp::presentLoop()
+	{
+		std::unique_lock<std::mutex> lock(m_present_mutex);
+		while (true)
+		{
+			m_present_cond.wait(lock, [this] { return m_present_pending || m_present_exit; });
+			if (m_present_exit)
+				return;
+
+			lock.unlock();
+			blitToScreenSurface(m_present_pixels, m_present_width, m_present_height, m_present_channel);
+			lock.lock();
+
+			m_present_pending = false;
+			m_present_cond.notify_all();
+		}
+	}
+
+	void TRWindowsApp::waitForPresent()
+	{
+		std::unique_lock<std::mutex> lock(m_present_mutex);
+		m_present_cond.wait(lock, [this] { return !m_present_pending; });
+	}
+
+	void TRWindowsApp::blitToScreenSurface(const unsigned char *pixels, int width, int height, int channel)
+	{
+		SDL_LockSurface(m_screen_surface);
+		{
+			const int w = std::min(width, m_screen_surface->w);
+			const int h = std::min(height, m_screen_surface->h);
+			for (int y = 0; y < h; ++y)
+			{
+				const unsigned char *src = pixels + y * width * channel;
+				Uint32 *dst = reinterpret_cast<Uint32*>(static_cast<unsigned char*>(m_screen_surface->pixels) + y * m_screen_surface->pitch);
+				if (channel == 4 && m_blit_mode == TRBlitMode::TR_BLIT_COPY)
+				{
+					std::memcpy(dst, src, w * 4);
+				}
+				else if (channel == 4 && m_blit_mode == TRBlitMode::TR_BLIT_SWAP_RB)
+				{
+					copySwapRedBlue(dst, src, w);
+				}
+				else
+				{
+					for (int x = 0; x < w; ++x)
+					{
+						dst[x] = SDL_MapRGB(
+							m_screen_surface->format,
+							static_cast<uint8_t>(src[x * channel + 0]),
+							static_cast<uint8_t>(src[x * channel + 1]),
+							static_cast<uint8_t>(src[x * channel + 2]));
+					}
+				}
+			}
+		}
+		SDL_UnlockSurface(m_screen_surface);
+	}
+
 	TRWindowsApp::ptr TRWindowsApp::getInstance()
 	{
 		if (m_instance == nullptr)
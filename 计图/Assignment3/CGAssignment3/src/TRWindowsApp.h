@@ -6,6 +6,9 @@
 #include <string>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 namespace TinyRenderer
 {
 	class TRWindowsApp final
@@ -68,6 +71,9 @@ namespace TinyRenderer
 		bool getIsMouseLeftButtonPressed() const { return m_mouse_left_button_pressed; }
 
 		//Copy the rendered image to screen for displaying
+		//Note: the image is copied to the screen surface on the present thread while the next frame
+		//      is rendered, and shown on the next call. So the pixels must stay unchanged until then,
+		//      which holds for the front buffer of TRRenderer.
 		double updateScreenSurface(
 			unsigned char *pixels,
 			int width, 
@@ -79,6 +85,20 @@ namespace TinyRenderer
 		static TRWindowsApp::ptr getInstance();
 		static TRWindowsApp::ptr getInstance(int width, int height, const std::string title = "winApp");
 
+	private:
+
+		//How the RGBA8 pixels are copied to the screen surface
+		enum class TRBlitMode
+		{
+			TR_BLIT_COPY,         // same layout, straight copy
+			TR_BLIT_SWAP_RB,      // red and blue swapped (e.g. ARGB8888 surface)
+			TR_BLIT_MAP_RGB       // any other layout, per-pixel SDL_MapRGB
+		};
+
+		void presentLoop();
+		void waitForPresent();
+		void blitToScreenSurface(const unsigned char *pixels, int width, int height, int channel);
+
 	private:
 
 		//Mouse tracking
@@ -111,6 +131,18 @@ namespace TinyRenderer
 		//Window handler
 		SDL_Window* m_window_handle = nullptr;
 		SDL_Surface* m_screen_surface = nullptr;
+		TRBlitMode m_blit_mode = TRBlitMode::TR_BLIT_MAP_RGB;
+
+		//Present thread, it only touches the screen surface pixels
+		//Note: the window calls (SDL_UpdateWindowSurface etc.) stay on the main thread
+		std::thread m_present_thread;
+		std::mutex m_present_mutex;
+		std::condition_variable m_present_cond;
+		const unsigned char *m_present_pixels = nullptr;
+		int m_present_width = 0, m_present_height = 0, m_present_channel = 0;
+		bool m_present_pending = false;     // submitted and not copied yet
+		bool m_present_copied = false;      // copied and not shown yet
+		bool m_present_exit = false;
 
 		//Singleton pattern
 		static TRWindowsApp::ptr m_instance;